@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include "buffer.h"
+#include "storage.h"
+#include "batch.h"
+#include "batchfile.h"
+#include "clienttable.h"
+
+#define REPEATS 5                   // Every benchmark is run this many times, the best run is reported
+
+// From producent.c (built with PRODUCENT_NO_MAIN)
+void pollClients(int *, struct ClientTable *, struct StorageShards *, struct BatchPool *);
+void updateStorage(struct Storage *, int);
+char nextBlock(char *, char);
+
+struct Benchmark
+{
+    const char * name;
+    long long iterations;
+    void (*run)(long long);
+};
+
+void benchBuffer(long long);
+void benchSend(long long);
+void benchUpdateStorage(long long);
+void benchBlock(long long);
+long long monotonicNow(void);
+
+volatile long long sink;            // Results go here so the loops aren't optimized away
+
+int main(int argc, char ** argv)
+{
+    // bench [<name filter>] - ns per operation of the producent's hot paths
+    struct Benchmark benchmarks[] = {
+        {"buffer push/pop", 20000000, benchBuffer},
+        {"pollClients send", 20000, benchSend},
+        {"updateStorage", 1000000, benchUpdateStorage},
+        {"workWork block", 5000000, benchBlock},
+    };
+    int benchmarkCount = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+    fprintf(stderr, "\n----- BENCHMARKS -----\n");
+    for(int i = 0; i < benchmarkCount; i++)
+    {
+        if(argc > 1 && strstr(benchmarks[i].name, argv[1]) == NULL)
+            continue;
+        long long best = -1;
+        for(int repeat = 0; repeat < REPEATS; repeat++)
+        {
+            long long start = monotonicNow();
+            benchmarks[i].run(benchmarks[i].iterations);
+            long long elapsed = monotonicNow() - start;
+            if(best == -1 || elapsed < best)
+                best = elapsed;
+        }
+        fprintf(stderr, "%-20s %10.1lf ns/op (best of %d, %lld iterations)\n", benchmarks[i].name,
+                (double)best / benchmarks[i].iterations, REPEATS, benchmarks[i].iterations);
+    }
+    fprintf(stderr, "----------------------\n");
+    return 0;
+}
+
+long long monotonicNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void benchBuffer(long long iterations)
+{
+    // The client queue: half full, one push and one pop per iteration
+    struct buffer * queue = create(MAX_CLIENTS);
+    for(int i = 0; i < MAX_CLIENTS / 2; i++)
+        push(queue, i);
+    long long sum = 0;
+    for(long long i = 0; i < iterations; i++)
+    {
+        push(queue, (int)i);
+        sum += pop(queue);
+    }
+    sink = sum;
+    delete(queue);
+}
+
+void benchSend(long long iterations)
+{
+    // One client on a socketpair sent a whole batch through pollClients, the other end drains it
+    int pipeFD[2];
+    int sockets[2];
+    errno = 0;
+    if(pipe(pipeFD) == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1)
+    {
+        perror("bench setup");
+        exit(EXIT_FAILURE);
+    }
+    int bufferSize = 4 * SEND_THRESHOLD;
+    setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(sockets[1], SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    char block[BLOCK_SIZE];
+    char value = 'A';
+    for(int written = 0; written < SEND_THRESHOLD; written += BLOCK_SIZE)
+    {
+        value = nextBlock(block, value);
+        if(write(pipeFD[1], block, BLOCK_SIZE) != BLOCK_SIZE)
+        {
+            perror("bench write pipe");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct StorageShards shards = {.count = 1, .pipeRead = {pipeFD[0]}, .controlWrite = {-1}};
+    struct BatchPool pool;
+    setupBatchPool(&pool, -1, 1, &shards);
+    updateStorage(&shards.storage[0], pipeFD[0]);
+    int batch = takeBatch(&pool, &shards);
+    if(batch == -1)
+    {
+        fprintf(stderr, "bench: no batch assembled\n");
+        exit(EXIT_FAILURE);
+    }
+    bindBatch(&pool, batch);
+
+    static struct ClientTable table;
+    memset(&table, 0, sizeof(table));
+    histogramInit(&table.queueWait, "queueWait");
+    histogramInit(&table.firstByte, "firstByte");
+    addClient(&table, sockets[0], batch, 0);
+
+    char drain[SEND_THRESHOLD];
+    for(long long i = 0; i < iterations; i++)
+    {
+        table.alreadySent[0] = 0;
+        int received = 0;
+        while(received < SEND_THRESHOLD)
+        {
+            if(table.alreadySent[0] < SEND_THRESHOLD)
+            {
+                int ready = 1;
+                table.pollFD[POLL_FIXED].revents = POLLOUT;
+                pollClients(&ready, &table, &shards, &pool);
+            }
+            int num = recv(sockets[1], drain, sizeof(drain), MSG_DONTWAIT);
+            if(num > 0)
+                received += num;
+        }
+    }
+    sink = table.firstByte.totalCount;
+    close(sockets[0]);
+    close(sockets[1]);
+    close(pipeFD[0]);
+    close(pipeFD[1]);
+    munmap(pool.batches, POOL_BATCHES * sizeof(struct Batch));
+    close(pool.fd);
+    delete(pool.readyBatches);
+}
+
+void benchUpdateStorage(long long iterations)
+{
+    // FIONREAD + F_GETPIPE_SZ on a storage pipe with some data in it
+    int pipeFD[2];
+    errno = 0;
+    if(pipe(pipeFD) == -1)
+    {
+        perror("bench pipe");
+        exit(EXIT_FAILURE);
+    }
+    char block[BLOCK_SIZE] = {};
+    if(write(pipeFD[1], block, BLOCK_SIZE) != BLOCK_SIZE)
+    {
+        perror("bench write pipe");
+        exit(EXIT_FAILURE);
+    }
+    struct Storage storage = {};
+    for(long long i = 0; i < iterations; i++)
+        updateStorage(&storage, pipeFD[0]);
+    sink = storage.currentStorage;
+    close(pipeFD[0]);
+    close(pipeFD[1]);
+}
+
+void benchBlock(long long iterations)
+{
+    // The worker's block generation (without the pipe write)
+    char block[BLOCK_SIZE];
+    char value = 'A';
+    long long sum = 0;
+    for(long long i = 0; i < iterations; i++)
+    {
+        value = nextBlock(block, value);
+        __asm__ volatile("" :: "r"(block) : "memory");  // The whole block is observable - the memset can't be dropped
+        sum += block[BLOCK_SIZE - 1];
+    }
+    sink = sum;
+}
@@ -0,0 +1,242 @@
+#include "clientstorage.h"
+#include "decay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define POOL_START 4096         // Blocks allocated up front, doubled when full
+
+static int allocBlock(struct ClientStorage *);
+static void freeBlock(struct ClientStorage *, int);
+static void wheelInsert(struct ClientStorage *, int);
+static void wheelCascade(struct ClientStorage *, int);
+static void expireBlock(struct ClientStorage *, int);
+static void drainLinear(struct ClientStorage *, long long);
+
+void clientStorageInit(struct ClientStorage * storage, enum DecayPolicy policy, double rate, double lifetime, long long now)
+{
+    memset(storage, 0, sizeof(*storage));
+    storage->policy = policy;
+    storage->rate = rate;
+    storage->lifetime = lifetime;
+    storage->now = now;
+    storage->freeBlocks = -1;
+    storage->fifoFirst = storage->fifoLast = -1;
+    for(int level = 0; level < WHEEL_LEVELS; level++)
+        for(int slot = 0; slot < WHEEL_SLOTS; slot++)
+            storage->wheel[level][slot] = -1;
+}
+
+void clientStorageSetup(struct ClientStorage * storage, enum DecayPolicy policy, float decayRate, int depoCapacity,
+                        double lifetime, long long now)
+{
+    // konsument's -d/-c/-t (lifetime in s): without a lifetime ttl/exp blocks last as long as the linear model
+    // takes to drain a full depo
+    double decayPerSecond = (double)decayRate * DECAY_RATE;
+    if(lifetime < 0)
+        lifetime = decayPerSecond > 0 ? (double)depoCapacity * CAPACITY_MULT / decayPerSecond : 0;
+    clientStorageInit(storage, policy, decayPerSecond / 1000, lifetime * 1000, now);
+}
+
+void clientStorageFree(struct ClientStorage * storage)
+{
+    free(storage->blocks);
+    storage->blocks = NULL;
+    storage->poolSize = 0;
+    storage->freeBlocks = -1;
+}
+
+static int allocBlock(struct ClientStorage * storage)
+{
+    if(storage->freeBlocks == -1)
+    {
+        int newSize = storage->poolSize ? storage->poolSize * 2 : POOL_START;
+        struct Block * blocks = realloc(storage->blocks, newSize * sizeof(struct Block));
+        if(blocks == NULL)
+        {
+            perror("realloc client storage");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = newSize - 1; i >= storage->poolSize; i--)
+        {
+            blocks[i].next = storage->freeBlocks;
+            storage->freeBlocks = i;
+        }
+        storage->blocks = blocks;
+        storage->poolSize = newSize;
+    }
+    int index = storage->freeBlocks;
+    storage->freeBlocks = storage->blocks[index].next;
+    storage->blockCount++;
+    return index;
+}
+
+static void freeBlock(struct ClientStorage * storage, int index)
+{
+    storage->blocks[index].next = storage->freeBlocks;
+    storage->freeBlocks = index;
+    storage->blockCount--;
+}
+
+static void wheelInsert(struct ClientStorage * storage, int index)
+{
+    // Level by how far away the expiry is, slot by the expiry's own bits on that level (like the kernel's timer wheel)
+    long long expiry = storage->blocks[index].expiry;
+    if(expiry <= storage->now)          // The current tick's slot is already done - next one
+        expiry = storage->now + 1;
+    long long delta = expiry - storage->now;
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= (1LL << (WHEEL_BITS * (level + 1))))
+        level++;
+    if(delta >= (1LL << (WHEEL_BITS * WHEEL_LEVELS)))       // Beyond the wheel - parked in the furthest slot,
+        expiry = storage->now + (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;   // re-inserted when it's cascaded
+    int slot = (int)((expiry >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    storage->blocks[index].next = storage->wheel[level][slot];
+    storage->wheel[level][slot] = index;
+}
+
+static void wheelCascade(struct ClientStorage * storage, int level)
+{
+    // Lower level wrapped around - this level's current slot moves down, what's due this very tick expires now
+    int slot = (int)((storage->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    if(level + 1 < WHEEL_LEVELS && slot == 0)
+        wheelCascade(storage, level + 1);
+    int index = storage->wheel[level][slot];
+    storage->wheel[level][slot] = -1;
+    while(index != -1)
+    {
+        int next = storage->blocks[index].next;
+        if(storage->blocks[index].expiry <= storage->now)
+            expireBlock(storage, index);
+        else
+            wheelInsert(storage, index);
+        index = next;
+    }
+}
+
+static void expireBlock(struct ClientStorage * storage, int index)
+{
+    struct Block * block = &storage->blocks[index];
+    if(storage->policy == DECAY_TTL)
+        storage->capacity -= block->size;
+    else        // What's left of it - under a byte
+        storage->capacity -= block->size * exp(-(double)(storage->now - block->arrival) / storage->lifetime);
+    if(storage->capacity < 0)
+        storage->capacity = 0;
+    storage->pending--;
+    freeBlock(storage, index);
+}
+
+static void drainLinear(struct ClientStorage * storage, long long elapsed)
+{
+    // Oldest blocks go first, the last one touched only partially
+    storage->drainDebt += storage->rate * elapsed;
+    while(storage->fifoFirst != -1 && storage->drainDebt >= 1)
+    {
+        struct Block * block = &storage->blocks[storage->fifoFirst];
+        int drained = storage->drainDebt >= block->size ? block->size : (int)storage->drainDebt;
+        block->size -= drained;
+        storage->drainDebt -= drained;
+        storage->capacity -= drained;
+        if(block->size == 0)
+        {
+            int index = storage->fifoFirst;
+            storage->fifoFirst = block->next;
+            if(storage->fifoFirst == -1)
+                storage->fifoLast = -1;
+            freeBlock(storage, index);
+        }
+    }
+    if(storage->fifoFirst == -1)        // Nothing left to decay - no debt carried over to the next block
+        storage->drainDebt = 0;
+}
+
+void clientStorageAdvance(struct ClientStorage * storage, long long now)
+{
+    if(now <= storage->now)
+        return;
+    if(storage->policy == DECAY_LINEAR)
+    {
+        drainLinear(storage, now - storage->now);
+        storage->now = now;
+        return;
+    }
+    if(storage->policy == DECAY_EXP && storage->lifetime > 0)
+        storage->capacity *= exp(-(double)(now - storage->now) / storage->lifetime);
+    while(storage->now < now)
+    {
+        if(storage->pending == 0)       // Nothing to expire - skip the ticks
+        {
+            storage->now = now;
+            break;
+        }
+        storage->now++;
+        if((storage->now & (WHEEL_SLOTS - 1)) == 0)
+            wheelCascade(storage, 1);
+        int slot = (int)(storage->now & (WHEEL_SLOTS - 1));
+        int index = storage->wheel[0][slot];
+        storage->wheel[0][slot] = -1;
+        while(index != -1)
+        {
+            int next = storage->blocks[index].next;
+            if(storage->blocks[index].expiry <= storage->now)
+                expireBlock(storage, index);
+            else                        // Parked beyond the wheel
+                wheelInsert(storage, index);
+            index = next;
+        }
+    }
+}
+
+void clientStorageAdd(struct ClientStorage * storage, int size, long long arrival)
+{
+    clientStorageAdvance(storage, arrival);
+    int index = allocBlock(storage);
+    struct Block * block = &storage->blocks[index];
+    block->arrival = arrival;
+    block->size = size;
+    block->next = -1;
+    storage->capacity += size;
+    if(storage->policy == DECAY_LINEAR)
+    {
+        if(storage->fifoLast == -1)
+            storage->fifoFirst = index;
+        else
+            storage->blocks[storage->fifoLast].next = index;
+        storage->fifoLast = index;
+        return;
+    }
+    if(storage->lifetime <= 0)          // Never expires - tracked for the count only
+        return;
+    if(storage->policy == DECAY_TTL)
+        block->expiry = arrival + (long long)storage->lifetime;
+    else                                // Under a byte after lifetime * ln(size)
+        block->expiry = arrival + (long long)(storage->lifetime * log(size > 1 ? size : 1)) + 1;
+    storage->pending++;
+    wheelInsert(storage, index);
+}
+
+bool parseDecayPolicy(const char * name, enum DecayPolicy * policy)
+{
+    for(enum DecayPolicy candidate = DECAY_LINEAR; candidate <= DECAY_EXP; candidate++)
+    {
+        if(strcmp(name, decayPolicyName(candidate)) == 0)
+        {
+            *policy = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char * decayPolicyName(enum DecayPolicy policy)
+{
+    switch(policy)
+    {
+        case DECAY_LINEAR: return "linear";
+        case DECAY_TTL: return "ttl";
+        default: return "exp";
+    }
+}
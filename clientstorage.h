@@ -0,0 +1,59 @@
+#ifndef MODELMIESZANY_CLIENTSTORAGE_H
+#define MODELMIESZANY_CLIENTSTORAGE_H
+
+#include <stdbool.h>
+
+// Konsument's storage, block by block. Every received block is tracked with its arrival time (ms, CLOCK_MONOTONIC)
+// and removed according to the decay policy:
+//  linear - the storage loses a fixed amount of bytes per second, oldest blocks first (the original model)
+//  ttl    - every block is dropped whole once it's `lifetime` ms old
+//  exp    - every block shrinks by e^(-age/lifetime), it's dropped once it's under a byte
+// Block expiry (ttl, exp) goes through a hierarchical timing wheel: O(1) insert, O(1) per expired block.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)           // Slots per level
+#define WHEEL_LEVELS 4                          // 1 ms ticks - the top level reaches ~4.6 hours
+
+enum DecayPolicy
+{
+    DECAY_LINEAR,
+    DECAY_TTL,
+    DECAY_EXP
+};
+
+struct Block
+{
+    long long arrival;          // ms
+    long long expiry;           // ms (ttl, exp)
+    int size;                   // Bytes left (linear drains the oldest block partially)
+    int next;                   // Next block in the wheel slot / FIFO / free list, -1 - none
+};
+
+struct ClientStorage
+{
+    enum DecayPolicy policy;
+    double rate;                // linear: bytes per ms
+    double lifetime;            // ttl: block lifetime, exp: time constant (ms), 0 - blocks don't expire
+    double capacity;            // Bytes held right now
+    double drainDebt;           // linear: fraction of a byte not drained yet
+    long long now;              // ms the model is advanced to
+    long long blockCount;
+    long long pending;          // Blocks in the wheel
+
+    struct Block * blocks;      // Pool - indices stay valid when it grows
+    int poolSize;
+    int freeBlocks;             // Free list head
+
+    int fifoFirst;              // linear: oldest block
+    int fifoLast;
+    int wheel[WHEEL_LEVELS][WHEEL_SLOTS];       // Slot list heads
+};
+
+void clientStorageInit(struct ClientStorage *, enum DecayPolicy, double, double, long long);
+void clientStorageSetup(struct ClientStorage *, enum DecayPolicy, float, int, double, long long);
+void clientStorageFree(struct ClientStorage *);
+void clientStorageAdd(struct ClientStorage *, int, long long);
+void clientStorageAdvance(struct ClientStorage *, long long);
+bool parseDecayPolicy(const char *, enum DecayPolicy *);
+const char * decayPolicyName(enum DecayPolicy);
+
+#endif //MODELMIESZANY_CLIENTSTORAGE_H
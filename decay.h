@@ -0,0 +1,12 @@
+#ifndef MODELMIESZANY_DECAY_H
+#define MODELMIESZANY_DECAY_H
+
+// konsument's client model, shared with the capacity planning simulator
+#define CAPACITY_MULT 30720
+#define READ_RATE 4435
+#define DECAY_RATE 819
+#define READ_SIZE 4096
+#define FULL_READ 13312
+#define MAX_PARALLEL 64          // Max batch connections in flight (-j)
+
+#endif //MODELMIESZANY_DECAY_H
@@ -0,0 +1,98 @@
+#include "histogram.h"
+
+#include <string.h>
+#include <limits.h>
+
+static int bucketIndex(long long value)
+{
+    if(value < 2 * HISTOGRAM_SUB_BUCKETS)
+        return (int)value;
+    int shift = (63 - __builtin_clzll((unsigned long long)value)) - HISTOGRAM_SUB_BITS;
+    if(shift > HISTOGRAM_MAX_SHIFT)
+        return HISTOGRAM_BUCKETS - 1;
+    // value >> shift lands in [HISTOGRAM_SUB_BUCKETS, 2*HISTOGRAM_SUB_BUCKETS)
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+static long long bucketHighest(int index)
+{
+    // Highest value that lands in the bucket
+    if(index < 2 * HISTOGRAM_SUB_BUCKETS)
+        return index;
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    long long sub = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histogramInit(struct Histogram * histogram, const char * name)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->name = name;
+    histogram->min = LLONG_MAX;
+}
+
+void histogramRecord(struct Histogram * histogram, long long value)
+{
+    if(value < 0)               // Clock jitter between two sources, not a real negative interval
+        value = 0;
+    histogram->counts[bucketIndex(value)]++;
+    histogram->totalCount++;
+    histogram->sum += (double)value;
+    if(value < histogram->min)
+        histogram->min = value;
+    if(value > histogram->max)
+        histogram->max = value;
+}
+
+long long histogramPercentile(struct Histogram * histogram, double percentile)
+{
+    if(histogram->totalCount == 0)
+        return 0;
+    long long target = (long long)(percentile / 100.0 * histogram->totalCount + 0.5);
+    if(target < 1)
+        target = 1;
+    long long seen = 0;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if(seen >= target)
+            return bucketHighest(i) < histogram->max ? bucketHighest(i) : histogram->max;
+    }
+    return histogram->max;
+}
+
+void histogramPrintText(FILE * out, struct Histogram * histogram)
+{
+    if(histogram->totalCount == 0)
+    {
+        fprintf(out, "%-18s count: 0\n", histogram->name);
+        return;
+    }
+    fprintf(out, "%-18s count: %lld, min: %.3lfms, mean: %.3lfms, p50: %.3lfms, p90: %.3lfms, "
+                 "p99: %.3lfms, p99.9: %.3lfms, max: %.3lfms\n",
+            histogram->name, histogram->totalCount, histogram->min / 1e6,
+            histogram->sum / histogram->totalCount / 1e6,
+            histogramPercentile(histogram, 50) / 1e6, histogramPercentile(histogram, 90) / 1e6,
+            histogramPercentile(histogram, 99) / 1e6, histogramPercentile(histogram, 99.9) / 1e6,
+            histogram->max / 1e6);
+}
+
+void histogramPrintJson(FILE * out, struct Histogram * histogram)
+{
+    // Values in ns. Buckets are [highest value in bucket, count] pairs, empty ones left out.
+    fprintf(out, "\"%s\": {\"unit\": \"ns\", \"count\": %lld, \"min\": %lld, \"mean\": %.0lf, "
+                 "\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld, \"buckets\": [",
+            histogram->name, histogram->totalCount, histogram->totalCount ? histogram->min : 0,
+            histogram->totalCount ? histogram->sum / histogram->totalCount : 0.0,
+            histogramPercentile(histogram, 50), histogramPercentile(histogram, 90),
+            histogramPercentile(histogram, 99), histogramPercentile(histogram, 99.9), histogram->max);
+    bool first = true;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        if(histogram->counts[i] == 0)
+            continue;
+        fprintf(out, "%s[%lld, %lld]", first ? "" : ", ", bucketHighest(i), histogram->counts[i]);
+        first = false;
+    }
+    fprintf(out, "]}");
+}
@@ -0,0 +1,30 @@
+#ifndef MODELMIESZANY_HISTOGRAM_H
+#define MODELMIESZANY_HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// HDR-style log-linear histogram: exact below 2*HISTOGRAM_SUB_BUCKETS, then HISTOGRAM_SUB_BUCKETS buckets
+// per power of two (~1.6% relative error). Covers 0ns up to ~2^47ns (39 hours), larger values are clamped.
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_SHIFT 41
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT + 2) * HISTOGRAM_SUB_BUCKETS)
+
+struct Histogram
+{
+    const char * name;
+    long long counts[HISTOGRAM_BUCKETS];
+    long long totalCount;
+    long long min;
+    long long max;
+    double sum;
+};
+
+void histogramInit(struct Histogram *, const char *);
+void histogramRecord(struct Histogram *, long long);
+long long histogramPercentile(struct Histogram *, double);
+void histogramPrintText(FILE *, struct Histogram *);
+void histogramPrintJson(FILE *, struct Histogram *);
+
+#endif //MODELMIESZANY_HISTOGRAM_H
@@ -7,22 +7,43 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "decay.h"
+#include "histogram.h"
+#include "clientstorage.h"
+#include "status.h"
 
 #define LOCALHOST "127.0.0.1"
-#define CAPACITY_MULT 30720
-#define READ_RATE 4435
-#define DECAY_RATE 819
-#define SAFE_MAX 50
-#define READ_SIZE 4096
-#define FULL_READ 13312
+#define REPORT_CHUNK 4096        // Reports per chunk of the report log
+#define MAX_ENDPOINTS 16         // Max producents to balance between
+#define STATUS_WAIT 50           // ms to wait for the status replies
+#define FAILOVER_BACKOFF 1000    // ms a producent that refused or dropped us is left alone
+
+struct Endpoint                 // One producent
+{
+    char locAddress[16];
+    size_t port;
+    struct sockaddr_in sockAddr;
+    int spareBatches;           // Last status reply: batches in the free storage - queued clients
+    int replyOrder;             // Last status query: 0 - replied first, -1 - didn't reply
+    struct timespec downUntil;  // Refused or dropped us - not used before this
+};
 
 struct InputArguments
 {
     int depoCapacity;
     float readingRate;
     float decayRate;
-    char locAddress[16];
-    size_t port;
+    struct Endpoint endpoints[MAX_ENDPOINTS];
+    int endpointCount;
+    char * summaryPath;         // JSON summary (-o), NULL if not requested
+    int parallelCount;          // -j, batch connections in flight at once
+    enum DecayPolicy decayPolicy;       // -m, how the received blocks decay
+    double lifetime;            // -t, ttl: block lifetime, exp: time constant (s), <0 - derived from -c and -d
 };
 
 struct Server
@@ -33,39 +54,131 @@ struct Server
 
 struct Report
 {
+    struct timespec connectStartTS;
     struct timespec connectionTS;
     struct timespec firstBatchTS;
+    struct timespec lastBatchTS;
     struct timespec closedTS;
     struct timespec generationTS;
     struct sockaddr_in connectionAddress;
     int blockID;
+    bool completed;             // Only completed connections get written out
+};
+
+struct Connection               // One batch in flight
+{
+    struct Server server;
+    struct Endpoint * endpoint;
+    struct Report * report;
+    int readSum;
+    struct timespec nextReadTS;     // Emulated reading rate - the next read can't start earlier
+    bool active;
+    struct Report * prevReport;     // Last batch completed on this connection (-j) - closed - next connect gap, NULL - none
+};
+
+struct ReportChunk
+{
+    struct Report reports[REPORT_CHUNK];
+    struct ReportChunk * next;
+};
+
+struct ReportLog                // Grows a chunk at a time - reports never move once handed out
+{
+    struct ReportChunk * first;
+    struct ReportChunk * last;
+    int count;
+};
+
+struct LatencyStats
+{
+    struct Histogram connectLatency;    // connect() call
+    struct Histogram timeToFirstByte;   // connected - first byte (includes the server queue)
+    struct Histogram batchTransfer;     // first byte - last byte
+    struct Histogram interBatchGap;     // closed - next connect (of the same connection)
+    int kernelTimestamps;               // Receives stamped by the kernel (SO_TIMESTAMPING)
+    int userTimestamps;                 // Receives stamped after recvmsg returned
+    long long realtimeOffset;           // CLOCK_REALTIME - CLOCK_MONOTONIC, sampled once so kernel stamps stay comparable
+    char * summaryPath;
 };
 
 void parseInputArguments(int, char**, struct InputArguments *);
 void checkArgCount(int, char **);
 void parseInputAddr(char**, struct InputArguments *);
-void setupConnection(struct InputArguments *, struct Server *);
-void receiveData(struct Server *, struct Report *, struct InputArguments *);
-int readFromServer(struct Server *, int , struct InputArguments *, struct Report *);
-void updateStorage(long *, int, struct timespec *, struct InputArguments *);
+void parseEndpoint(char *, struct Endpoint *);
+void setupConnection(struct Endpoint *, struct Server *);
+void receiveData(struct ReportLog *, struct InputArguments *, struct LatencyStats *);
+bool openConnection(struct Connection *, struct Endpoint *, struct ReportLog *, struct InputArguments *);
+int preparePoll(struct Connection *, struct pollfd *, int);
+int readFromServer(struct Connection *, struct ClientStorage *, struct InputArguments *, struct LatencyStats *);
+int setupStatusSocket(void);
+void queryEndpoints(int, struct InputArguments *);
+struct Endpoint * pickEndpoint(struct InputArguments *);
+void markDown(struct Endpoint *);
+bool isDown(struct Endpoint *);
+long projectedCapacity(struct ClientStorage *, struct Connection *, int);
+int receiveWithTimestamp(int, char *, int, struct timespec *, struct LatencyStats *);
+struct timespec realtimeToMonotonic(struct timespec, long long);
+long long timespecToNs(struct timespec);
+long long monotonicMs(void);
 
 int getInt(char * arg);
 double getFloat(char * arg);
 struct timespec timespecDifference(struct timespec, struct timespec);
+struct timespec timespecAdd(struct timespec, struct timespec);
 void parseTime(float, struct timespec *,int, int);
 
 struct sockaddr_in generateAddress(int);
-void generateReport(struct sockaddr_in);
-void reportOnConnection(int, void *);
+void generateReport(void);
+struct Report * newReport(struct ReportLog *);
+void reportOnConnection(FILE *, struct Report *);
+void writeReports(int, void *);
+void recordLatencies(struct LatencyStats *, struct Report *, struct timespec *);
+void reportSummary(int, void *);
 
 int main(int argc, char** argv)
 {
     struct InputArguments inputArguments;
-    struct Server server;
     parseInputArguments(argc, argv, &inputArguments);
-    struct Report reportTab[SAFE_MAX];
-    setupConnection(&inputArguments, &server);
-    receiveData(&server, reportTab, &inputArguments);
+    struct LatencyStats * latencyStats = malloc(sizeof(struct LatencyStats));
+    if(latencyStats == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    histogramInit(&latencyStats->connectLatency, "connectLatency");
+    histogramInit(&latencyStats->timeToFirstByte, "timeToFirstByte");
+    histogramInit(&latencyStats->batchTransfer, "batchTransfer");
+    histogramInit(&latencyStats->interBatchGap, "interBatchGap");
+    latencyStats->kernelTimestamps = 0;
+    latencyStats->userTimestamps = 0;
+    latencyStats->summaryPath = inputArguments.summaryPath;
+    struct timespec nowRealtime, nowMonotonic;
+    clock_gettime(CLOCK_REALTIME, &nowRealtime);
+    clock_gettime(CLOCK_MONOTONIC, &nowMonotonic);
+    latencyStats->realtimeOffset = timespecToNs(nowRealtime) - timespecToNs(nowMonotonic);
+    // Registered first - so it's executed last, after the per connection reports
+    errno = 0;
+    if(on_exit(reportSummary, (void*)latencyStats) != 0)
+    {
+        perror("registering on_exit");
+        exit(EXIT_FAILURE);
+    }
+
+    struct ReportLog * reportLog = calloc(1, sizeof(struct ReportLog));
+    if(reportLog == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    // Single writer for every connection report, in chronological order
+    errno = 0;
+    if(on_exit(writeReports, (void*)reportLog) != 0)
+    {
+        perror("registering on_exit");
+        exit(EXIT_FAILURE);
+    }
+
+    receiveData(reportLog, &inputArguments, latencyStats);
     return 0;
 }
 
@@ -82,7 +195,7 @@ struct sockaddr_in generateAddress(int fd)
     return myAddress;
 }
 
-void generateReport(struct sockaddr_in myAddress)
+void generateReport(void)
 {
     struct timespec time;
     clock_gettime(CLOCK_REALTIME, &time);
@@ -106,6 +219,19 @@ struct timespec timespecDifference(struct timespec early, struct timespec late)
     return diff;
 }
 
+struct timespec timespecAdd(struct timespec early, struct timespec interval)
+{
+    struct timespec sum;
+    sum.tv_sec = early.tv_sec + interval.tv_sec;
+    sum.tv_nsec = early.tv_nsec + interval.tv_nsec;
+    if(sum.tv_nsec >= 1e9)
+    {
+        sum.tv_sec++;
+        sum.tv_nsec -= 1e9;
+    }
+    return sum;
+}
+
 void parseTime(float multi, struct timespec * sleepTime, int size, int rate)
 {
     size_t nanoTime = size / (multi * rate) * 1000000000;
@@ -113,130 +239,476 @@ void parseTime(float multi, struct timespec * sleepTime, int size, int rate)
     sleepTime->tv_nsec = nanoTime % (size_t)(1000000000);
 }
 
-void reportOnConnection(int exit, void * arg)
+long long timespecToNs(struct timespec ts)
+{
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct timespec realtimeToMonotonic(struct timespec realtimeTS, long long realtimeOffset)
+{
+    // Kernel timestamps are CLOCK_REALTIME, every other report timestamp is CLOCK_MONOTONIC
+    struct timespec result;
+    long long monotonic = timespecToNs(realtimeTS) - realtimeOffset;
+    result.tv_sec = monotonic / 1000000000LL;
+    result.tv_nsec = monotonic % 1000000000LL;
+    return result;
+}
+
+void recordLatencies(struct LatencyStats * latencyStats, struct Report * report, struct timespec * prevClosedTS)
+{
+    histogramRecord(&latencyStats->connectLatency,
+                    timespecToNs(timespecDifference(report->connectStartTS, report->connectionTS)));
+    histogramRecord(&latencyStats->timeToFirstByte,
+                    timespecToNs(timespecDifference(report->connectionTS, report->firstBatchTS)));
+    histogramRecord(&latencyStats->batchTransfer,
+                    timespecToNs(timespecDifference(report->firstBatchTS, report->lastBatchTS)));
+    if(prevClosedTS != NULL)
+        histogramRecord(&latencyStats->interBatchGap,
+                        timespecToNs(timespecDifference(*prevClosedTS, report->connectStartTS)));
+}
+
+void reportSummary(int exit, void * arg)
+{
+    struct LatencyStats * latencyStats = (struct LatencyStats*)arg;
+    struct Histogram * histograms[] = {&latencyStats->connectLatency, &latencyStats->timeToFirstByte,
+                                       &latencyStats->batchTransfer, &latencyStats->interBatchGap};
+    int histogramCount = sizeof(histograms) / sizeof(histograms[0]);
+
+    fprintf(stderr, "\n----- LATENCY SUMMARY -----\n");
+    fprintf(stderr, "PID: %d, exit status: %d\n", getpid(), exit);
+    fprintf(stderr, "Receive timestamps - kernel: %d, userspace: %d\n", latencyStats->kernelTimestamps, latencyStats->userTimestamps);
+    for(int i = 0; i < histogramCount; i++)
+        histogramPrintText(stderr, histograms[i]);
+    fprintf(stderr, "---------------------------\n");
+
+    if(latencyStats->summaryPath == NULL)
+        return;
+    errno = 0;
+    FILE * json = fopen(latencyStats->summaryPath, "w");
+    if(json == NULL)
+    {
+        perror("fopen summary");
+        return;
+    }
+    fprintf(json, "{\"pid\": %d, \"exitStatus\": %d, \"kernelTimestamps\": %d, \"userTimestamps\": %d, \"histograms\": {",
+            getpid(), exit, latencyStats->kernelTimestamps, latencyStats->userTimestamps);
+    for(int i = 0; i < histogramCount; i++)
+    {
+        fprintf(json, "%s", i ? ", " : "");
+        histogramPrintJson(json, histograms[i]);
+    }
+    fprintf(json, "}}\n");
+    fclose(json);
+}
+
+struct Report * newReport(struct ReportLog * reportLog)
+{
+    int inChunk = reportLog->count % REPORT_CHUNK;
+    if(inChunk == 0)            // Last chunk full (or no chunk yet)
+    {
+        struct ReportChunk * chunk = malloc(sizeof(struct ReportChunk));
+        if(chunk == NULL)
+        {
+            perror("malloc report chunk");
+            exit(EXIT_FAILURE);
+        }
+        chunk->next = NULL;
+        if(reportLog->last == NULL)
+            reportLog->first = chunk;
+        else
+            reportLog->last->next = chunk;
+        reportLog->last = chunk;
+    }
+    struct Report * report = &reportLog->last->reports[inChunk];
+    memset(report, 0, sizeof(*report));
+    report->blockID = reportLog->count++;           // Give the connection an ID
+    return report;
+}
+
+void reportOnConnection(FILE * out, struct Report * thisReport)
 {
-    struct Report thisReport = *(struct Report*)arg;
     struct timespec diff1, diff2;
 
-    diff1 = timespecDifference(thisReport.connectionTS, thisReport.firstBatchTS);
-    diff2 = timespecDifference(thisReport.firstBatchTS, thisReport.closedTS);
+    diff1 = timespecDifference(thisReport->connectionTS, thisReport->firstBatchTS);
+    diff2 = timespecDifference(thisReport->firstBatchTS, thisReport->closedTS);
 
-    fprintf(stderr, "\n----- REPORT ID %d -----\n", thisReport.blockID);
-    fprintf(stderr, "PID: %d\n", getpid());
-    fprintf(stderr, "Connection address: %s:%hu\n", inet_ntoa(thisReport.connectionAddress.sin_addr), ntohs(thisReport.connectionAddress.sin_port));
-    fprintf(stderr, "firstBatch - connection : %lds %ldns\n", diff1.tv_sec, diff1.tv_nsec);
-    fprintf(stderr, "connection - closed : %lds %ldns\n", diff2.tv_sec, diff2.tv_nsec);
-    fprintf(stderr, "------------------------\n");
+    fprintf(out, "\n----- REPORT ID %d -----\n", thisReport->blockID);
+    fprintf(out, "PID: %d\n", getpid());
+    fprintf(out, "Connection address: %s:%hu\n", inet_ntoa(thisReport->connectionAddress.sin_addr), ntohs(thisReport->connectionAddress.sin_port));
+    fprintf(out, "firstBatch - connection : %lds %ldns\n", diff1.tv_sec, diff1.tv_nsec);
+    fprintf(out, "connection - closed : %lds %ldns\n", diff2.tv_sec, diff2.tv_nsec);
+    fprintf(out, "------------------------\n");
+}
 
+void writeReports(int exit, void * arg)
+{
+    struct ReportLog * reportLog = (struct ReportLog*)arg;
+    // stderr is unbuffered - with millions of reports go through a fully buffered stream on a dup of it
+    FILE * out = NULL;
+    int errFd = dup(STDERR_FILENO);
+    if(errFd != -1)
+        out = fdopen(errFd, "w");
+    if(out == NULL)
+        out = stderr;
+
+    int seen = 0;
+    int written = 0;            // Completed only - a dropped or unfinished connection has no report
+    for(struct ReportChunk * chunk = reportLog->first; chunk != NULL; chunk = chunk->next)
+    {
+        for(int i = 0; i < REPORT_CHUNK && seen < reportLog->count; i++, seen++)
+        {
+            if(chunk->reports[i].completed)
+            {
+                reportOnConnection(out, &chunk->reports[i]);
+                written++;
+            }
+        }
+    }
+    if(out != stderr)
+        fclose(out);
+    if(exit != 0)
+        fprintf(stderr, "Wrote reports of %d connections (%d not completed) before exiting with status %d.\n",
+                written, seen - written, exit);
 }
 
-void updateStorage(long * currentCapacity, const int readSum, struct timespec * startTime, struct InputArguments * inputArguments)
+long long monotonicMs(void)
 {
-    struct timespec decayTime, endTime;
-    *currentCapacity += readSum;                 // Update current capacity and decay
-    clock_gettime(CLOCK_MONOTONIC, &endTime);   // startTime - endTime is the interval in which decay occurs
-    decayTime = timespecDifference(*startTime, endTime);
-    // Remove decayed data
-    *currentCapacity -= (long) (decayTime.tv_sec * (inputArguments->decayRate * DECAY_RATE) + (decayTime.tv_nsec / 1e9) * (inputArguments->decayRate * DECAY_RATE));
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespecToNs(now) / 1000000LL;
 }
 
-int readFromServer(struct Server * server, int connectionIter, struct InputArguments * inputArguments, struct Report * reportTab)
+long projectedCapacity(struct ClientStorage * storage, struct Connection * connections, int count)
 {
-    int readSum = 0;
-    char buf[READ_SIZE+1]={};           // Could also read into /dev/null
-    while(readSum < FULL_READ)
+    // Exact capacity right now plus whatever the batches in flight still have to deliver
+    clientStorageAdvance(storage, monotonicMs());
+    long projected = (long)storage->capacity;
+    for(int i = 0; i < count; i++)
     {
+        if(connections[i].active)
+            projected += FULL_READ - connections[i].readSum;
+    }
+    return projected;
+}
 
-        // Determines the size of the package (READ_SIZE or whatever is left that is < than READ_SIZE)
-        errno = 0;
-        int readSize = ( FULL_READ - readSum > READ_SIZE ? READ_SIZE : FULL_READ - readSum );
-        int readNum = read(server->socketFd, buf, readSize);
-        if(readNum == -1)
+int receiveWithTimestamp(int fd, char * buf, int size, struct timespec * receiveTS, struct LatencyStats * latencyStats)
+{
+    // recvmsg + SO_TIMESTAMPING: receiveTS is when the kernel got the data (not when we got scheduled).
+    // Falls back to a userspace timestamp if the kernel didn't stamp it.
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    int readNum = recvmsg(fd, &message, 0);
+    clock_gettime(CLOCK_MONOTONIC, receiveTS);
+    if(readNum <= 0)
+        return readNum;
+
+    for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
         {
-            perror("read from server");
-            exit(EXIT_FAILURE);
+            struct scm_timestamping * stamps = (struct scm_timestamping*)CMSG_DATA(cmsg);
+            if(stamps->ts[0].tv_sec != 0 || stamps->ts[0].tv_nsec != 0)      // ts[0] - software timestamp
+            {
+                *receiveTS = realtimeToMonotonic(stamps->ts[0], latencyStats->realtimeOffset);
+                latencyStats->kernelTimestamps++;
+                return readNum;
+            }
         }
-        if (readNum == 0)       // read EOF (server DC before full transaction)
+    }
+    latencyStats->userTimestamps++;
+    return readNum;
+}
+
+bool openConnection(struct Connection * connection, struct Endpoint * endpoint, struct ReportLog * reportLog, struct InputArguments * inputArguments)
+{
+    // False if the producent refused us (only with more than one to fail over to)
+    setupConnection(endpoint, &connection->server);
+    connection->endpoint = endpoint;
+    connection->readSum = 0;
+    struct timespec connectStartTS;
+    clock_gettime(CLOCK_MONOTONIC, &connectStartTS);
+    errno = 0;
+    if((connect(connection->server.socketFd, (struct sockaddr *)&connection->server.sockAddr, sizeof(connection->server.sockAddr))) == -1)
+    {
+        if(inputArguments->endpointCount == 1)
         {
-            fprintf(stderr,"Unexpected DC from the server.\n");
+            perror("connecting to server");
             exit(EXIT_FAILURE);
-            // Could return -1 and make a DC report but I choose to exit.
         }
-        // Not checking if readSize != readNum (shouldn't be an error)
-        readSum += readNum;
-        if(readSum == readNum)      // This means it's 1st package received
-            clock_gettime(CLOCK_MONOTONIC, &reportTab[connectionIter].firstBatchTS);
-        struct timespec sleepTime;
-        parseTime(inputArguments->readingRate, &sleepTime, readNum, READ_RATE);
-        nanosleep(&sleepTime, NULL);        // No signal to interrupt.
-    }
-    return readSum;
+        fprintf(stderr, "Producent %s:%zu refused (%s), failing over.\n", endpoint->locAddress, endpoint->port, strerror(errno));
+        close(connection->server.socketFd);
+        markDown(endpoint);
+        return false;
+    }
+    connection->report = newReport(reportLog);
+    connection->report->connectStartTS = connectStartTS;
+    // Add this connection's address:port and connectionTS to its report
+    clock_gettime(CLOCK_MONOTONIC, &connection->report->connectionTS);
+    connection->report->connectionAddress = generateAddress(connection->server.socketFd);
+    connection->nextReadTS = connection->report->connectionTS;
+    connection->active = true;
+    return true;
 }
 
-void receiveData(struct Server * server, struct Report * reportTab, struct InputArguments * inputArguments)
+int setupStatusSocket(void)
 {
-    long depoCapacity = inputArguments->depoCapacity * CAPACITY_MULT;       // Max capacity
-    long currentCapacity = 0;                                               // Current capacity
-    struct timespec startTime;          // Decay start timestamp
-    struct sockaddr_in myAddress;       // Address that's put through to every connection report.
+    errno = 0;
+    int statusFd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(statusFd == -1)
+    {
+        perror("creating status socket");
+        exit(EXIT_FAILURE);
+    }
+    return statusFd;
+}
 
-    int connectionIter = 0;         // Number of connection
-    while(1)                        // True until capacity reached
+void queryEndpoints(int statusFd, struct InputArguments * inputArguments)
+{
+    // Asks every producent that's up how busy it is, waits STATUS_WAIT ms at most for the replies
+    uint32_t request = htonl(STATUS_MAGIC);
+    int asked = 0;
+    for(int i = 0; i < inputArguments->endpointCount; i++)
+    {
+        struct Endpoint * endpoint = &inputArguments->endpoints[i];
+        endpoint->replyOrder = -1;
+        if(isDown(endpoint))
+            continue;
+        errno = 0;
+        if(sendto(statusFd, &request, sizeof(request), 0, (struct sockaddr*)&endpoint->sockAddr, sizeof(endpoint->sockAddr)) == -1)
+            perror("sendto status");
+        else
+            asked++;
+    }
+
+    struct timespec deadline, now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = timespecAdd(now, (struct timespec){.tv_sec = 0, .tv_nsec = STATUS_WAIT * 1000000L});
+    int replies = 0;
+    while(replies < asked)
     {
-        clock_gettime(CLOCK_MONOTONIC, &startTime);     // Get decay start TS
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long wait = timespecToNs(deadline) - timespecToNs(now);
+        if(wait <= 0)
+            break;
+        struct pollfd statusPoll = {.fd = statusFd, .events = POLLIN};
         errno = 0;
-        if((connect(server->socketFd, (struct sockaddr *)&server->sockAddr, sizeof(server->sockAddr))) == -1)
+        if(poll(&statusPoll, 1, (int)((wait + 999999) / 1000000)) <= 0)
+            continue;
+        struct StatusReply reply;
+        struct sockaddr_in from;
+        socklen_t fromLength = sizeof(from);
+        int num = recvfrom(statusFd, &reply, sizeof(reply), MSG_DONTWAIT, (struct sockaddr*)&from, &fromLength);
+        if(num != sizeof(reply) || ntohl(reply.magic) != STATUS_MAGIC)
+            continue;
+        for(int i = 0; i < inputArguments->endpointCount; i++)
         {
-            perror("connecting to server");
-            exit(EXIT_FAILURE);
+            struct Endpoint * endpoint = &inputArguments->endpoints[i];
+            if(endpoint->replyOrder == -1 && endpoint->sockAddr.sin_addr.s_addr == from.sin_addr.s_addr
+               && endpoint->sockAddr.sin_port == from.sin_port)
+            {
+                endpoint->spareBatches = (int)(ntohl(reply.freeData) / FULL_READ) - (int)ntohl(reply.queued);
+                endpoint->replyOrder = replies++;
+                break;
+            }
         }
-        // Add this connection's address:port and connectionTS to reportTab structure
-        reportTab[connectionIter].connectionAddress = generateAddress(server->socketFd);
-        clock_gettime(CLOCK_MONOTONIC, &reportTab[connectionIter].connectionTS);
+    }
+}
 
-        // Read the FULL_READ bytes from server
-        int readSum = readFromServer(server, connectionIter, inputArguments, reportTab);
+struct Endpoint * pickEndpoint(struct InputArguments * inputArguments)
+{
+    // Most spare batches wins, the faster reply breaks a tie. Nobody replied - round robin over the ones that are up.
+    static int nextRobin = 0;
+    struct Endpoint * best = NULL;
+    for(int i = 0; i < inputArguments->endpointCount; i++)
+    {
+        struct Endpoint * endpoint = &inputArguments->endpoints[i];
+        if(isDown(endpoint) || endpoint->replyOrder == -1)
+            continue;
+        if(best == NULL || endpoint->spareBatches > best->spareBatches
+           || (endpoint->spareBatches == best->spareBatches && endpoint->replyOrder < best->replyOrder))
+            best = endpoint;
+    }
+    for(int i = 0; best == NULL && i < inputArguments->endpointCount; i++)
+    {
+        struct Endpoint * endpoint = &inputArguments->endpoints[nextRobin++ % inputArguments->endpointCount];
+        if(!isDown(endpoint))
+            best = endpoint;
+    }
+    if(best != NULL)
+        best->spareBatches--;           // We're about to take one
+    return best;
+}
+
+void markDown(struct Endpoint * endpoint)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    endpoint->downUntil = timespecAdd(now, (struct timespec){.tv_sec = FAILOVER_BACKOFF / 1000, .tv_nsec = FAILOVER_BACKOFF % 1000 * 1000000L});
+    endpoint->replyOrder = -1;
+}
+
+bool isDown(struct Endpoint * endpoint)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespecToNs(now) < timespecToNs(endpoint->downUntil);
+}
 
+int preparePoll(struct Connection * connections, struct pollfd * pollFD, int count)
+{
+    // Connections still "processing" their last read sit out of the poll (negative fd),
+    // the timeout is when the first of them is ready to read again (-1 if none is)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long timeout = -1;
+    for(int i = 0; i < count; i++)
+    {
+        pollFD[i].fd = -1;
+        pollFD[i].events = POLLIN;
+        pollFD[i].revents = 0;
+        if(!connections[i].active)
+            continue;
+        long long wait = timespecToNs(connections[i].nextReadTS) - timespecToNs(now);
+        if(wait <= 0)
+            pollFD[i].fd = connections[i].server.socketFd;
+        else if(timeout == -1 || (wait + 999999) / 1000000 < timeout)
+            timeout = (wait + 999999) / 1000000;
+    }
+    return (int)timeout;
+}
+
+int readFromServer(struct Connection * connection, struct ClientStorage * storage, struct InputArguments * inputArguments, struct LatencyStats * latencyStats)
+{
+    // One read of the batch: 1 - the server has closed the connection after all of it, 0 - more to read,
+    // -1 - the server dropped us mid batch (only with another producent to fail over to)
+    struct Report * report = connection->report;
+    errno = 0;
+    if(connection->readSum == FULL_READ)
+    {
         // Server has closed our connection - we read EOF
-        errno = 0;
-        int readByte = read(server->socketFd, NULL, 1);
+        char byte;
+        int readByte = read(connection->server.socketFd, &byte, 1);
         if(readByte != 0)
         {
             fprintf(stderr,"should have read EOF, instead read: %d", readByte);
             perror("read");
             exit(EXIT_FAILURE);
         }
+        clock_gettime(CLOCK_MONOTONIC, &report->closedTS);     // After reading EOF - get a TS
+        return 1;
+    }
 
-        clock_gettime(CLOCK_MONOTONIC, &reportTab[connectionIter].closedTS);    // After reading EOF - get a TS
-        reportTab[connectionIter].blockID = connectionIter;                     // Give the connection an ID
+    char buf[READ_SIZE+1]={};           // Could also read into /dev/null
+    // Determines the size of the package (READ_SIZE or whatever is left that is < than READ_SIZE)
+    int readSize = ( FULL_READ - connection->readSum > READ_SIZE ? READ_SIZE : FULL_READ - connection->readSum );
+    struct timespec receiveTS;
+    int readNum = receiveWithTimestamp(connection->server.socketFd, buf, readSize, &receiveTS, latencyStats);
+    if((readNum == -1 && errno != ECONNRESET) || ((readNum == -1 || readNum == 0) && inputArguments->endpointCount == 1))
+    {
+        if(readNum == -1)
+            perror("read from server");
+        else        // read EOF (server DC before full transaction)
+            fprintf(stderr,"Unexpected DC from the server.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(readNum <= 0)        // Another producent will get the batch request
+    {
+        fprintf(stderr, "Unexpected DC from %s:%zu, failing over.\n", connection->endpoint->locAddress, connection->endpoint->port);
+        markDown(connection->endpoint);
+        return -1;
+    }
+    // Not checking if readSize != readNum (shouldn't be an error)
+    connection->readSum += readNum;
+    clientStorageAdd(storage, readNum, timespecToNs(receiveTS) / 1000000LL);   // In storage from the moment it arrived
+    if(connection->readSum == readNum)      // This means it's 1st package received
+        report->firstBatchTS = receiveTS;
+    report->lastBatchTS = receiveTS;
+    struct timespec sleepTime, now;
+    parseTime(inputArguments->readingRate, &sleepTime, readNum, READ_RATE);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    connection->nextReadTS = timespecAdd(now, sleepTime);   // Instead of sleeping - the other connections go on
+    return 0;
+}
 
-        // on_exit registers a function that writes out a report (will be executed in reverse order though)
-        errno = 0;
-        int onExit = on_exit(reportOnConnection, (void*)&reportTab[connectionIter]);
-        if( onExit != 0)
+void receiveData(struct ReportLog * reportLog, struct InputArguments * inputArguments, struct LatencyStats * latencyStats)
+{
+    long depoCapacity = inputArguments->depoCapacity * CAPACITY_MULT;       // Max capacity
+    struct ClientStorage storage;       // Every block received, decayed up to the last check
+    struct Connection connections[MAX_PARALLEL] = {};
+    struct pollfd pollFD[MAX_PARALLEL];
+    int inFlight = 0;
+    int statusFd = inputArguments->endpointCount > 1 ? setupStatusSocket() : -1;
+
+    clientStorageSetup(&storage, inputArguments->decayPolicy, inputArguments->decayRate, inputArguments->depoCapacity,
+                       inputArguments->lifetime, monotonicMs());
+    while(1)                        // True until capacity reached
+    {
+        // New batch connections only while the projected capacity still has room for them
+        bool queried = false;
+        for(int i = 0; i < inputArguments->parallelCount; i++)
         {
-            perror("registering on_exit");
-            exit(EXIT_FAILURE);
+            if(!connections[i].active
+               && depoCapacity - projectedCapacity(&storage, connections, inputArguments->parallelCount) >= FULL_READ)
+            {
+                if(statusFd != -1 && !queried)      // One status round for all the connections opened now
+                {
+                    queryEndpoints(statusFd, inputArguments);
+                    queried = true;
+                }
+                struct Endpoint * endpoint = pickEndpoint(inputArguments);
+                if(endpoint == NULL)
+                {
+                    fprintf(stderr, "Every producent refused or dropped us.\n");
+                    exit(EXIT_FAILURE);
+                }
+                if(openConnection(&connections[i], endpoint, reportLog, inputArguments))
+                    inFlight++;
+                else
+                    i--;                            // Same connection, next producent
+            }
         }
-
-        close(server->socketFd);                    // Preparing for the next connection
-        setupConnection(inputArguments, server);    //
-
-        updateStorage(&currentCapacity, readSum, &startTime, inputArguments);  // Updates storage values (read - decay)
-
-        if(depoCapacity - currentCapacity < FULL_READ)  // Full capacity, success -> break leads into report and return;
+        if(inFlight == 0)           // Full capacity, success -> break leads into report and return;
             break;
-        if(connectionIter++ == SAFE_MAX)
+
+        int timeout = preparePoll(connections, pollFD, inputArguments->parallelCount);
+        errno = 0;
+        if(poll(pollFD, inputArguments->parallelCount, timeout) == -1)
         {
-            fprintf(stderr, "Reached SAFE_MAX amt of connections. [client got clinical depression and chose to end his existence]\n");
+            perror("poll");
             exit(EXIT_FAILURE);
         }
-
+        for(int i = 0; i < inputArguments->parallelCount; i++)
+        {
+            if(!(pollFD[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            int result = readFromServer(&connections[i], &storage, inputArguments, latencyStats);
+            if(result == 0)
+                continue;
+            if(result == -1)                        // Dropped - the report stays incomplete (not written)
+            {
+                close(connections[i].server.socketFd);
+                connections[i].active = false;
+                connections[i].prevReport = NULL;   // The next connect doesn't follow a close
+                inFlight--;
+                continue;
+            }
+
+            struct Report * report = connections[i].report;
+            report->completed = true;                               // writeReports prints it at exit
+            recordLatencies(latencyStats, report, connections[i].prevReport ? &connections[i].prevReport->closedTS : NULL);
+            connections[i].prevReport = report;     // Per connection - with -j the others overlap this one
+            close(connections[i].server.socketFd);
+            connections[i].active = false;
+            inFlight--;
+        }
     }
-    generateReport(myAddress);      // Ending report.
+    fprintf(stderr, "Storage (%s decay): %ld/%ld bytes in %lld blocks.\n", decayPolicyName(storage.policy),
+            (long)storage.capacity, depoCapacity, storage.blockCount);
+    generateReport();      // Ending report.
 }
 
-void setupConnection(struct InputArguments * inputArguments, struct Server * server)
+void setupConnection(struct Endpoint * endpoint, struct Server * server)
 {
     errno = 0;
     if((server->socketFd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
@@ -244,16 +716,12 @@ void setupConnection(struct InputArguments * inputArguments, struct Server * ser
         perror("creating socket");
         exit(EXIT_FAILURE);
     }
+    // Kernel receive timestamps for the latency summary (not fatal - falls back to clock_gettime)
+    int timestampFlags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if(setsockopt(server->socketFd, SOL_SOCKET, SO_TIMESTAMPING, &timestampFlags, sizeof(timestampFlags)) == -1)
+        perror("setsockopt SO_TIMESTAMPING");
 
-    server->sockAddr.sin_family = AF_INET;
-    server->sockAddr.sin_port = htons(inputArguments->port);
-
-    errno = 0;
-    if((inet_aton(inputArguments->locAddress, &server->sockAddr.sin_addr)) == 0)
-    {
-        perror("inet_aton couldn't parse provided address");
-        exit(EXIT_FAILURE);
-    }
+    server->sockAddr = endpoint->sockAddr;
 }
 
 
@@ -261,8 +729,12 @@ void parseInputArguments(int argc, char** argv, struct InputArguments * inputArg
 {
     bool cFlag = false, pFlag = false, dFlag = false;
     checkArgCount(argc, argv);
+    inputArguments->summaryPath = NULL;
+    inputArguments->parallelCount = 1;
+    inputArguments->decayPolicy = DECAY_LINEAR;
+    inputArguments->lifetime = -1;
     int opt;
-    while ((opt = getopt(argc, argv, ":c:p:d:")) != -1) {
+    while ((opt = getopt(argc, argv, ":c:p:d:o:j:m:t:")) != -1) {
         switch (opt) {
             case 'c':
                 inputArguments->depoCapacity = getInt(optarg);
@@ -276,18 +748,39 @@ void parseInputArguments(int argc, char** argv, struct InputArguments * inputArg
                 inputArguments->decayRate = (float)getFloat(optarg);
                 dFlag = true;
                 break;
+            case 'o':
+                inputArguments->summaryPath = optarg;
+                break;
+            case 'j':
+                inputArguments->parallelCount = getInt(optarg);
+                if(inputArguments->parallelCount < 1 || inputArguments->parallelCount > MAX_PARALLEL)
+                {
+                    fprintf(stderr, "Parallel connection count has to be between 1 and %d\n", MAX_PARALLEL);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                if(!parseDecayPolicy(optarg, &inputArguments->decayPolicy))
+                {
+                    fprintf(stderr, "Decay model has to be linear, ttl or exp\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                inputArguments->lifetime = getFloat(optarg);
+                break;
             case ':': // Missing argument
                 fprintf(stderr, "Missing argument!\n");
-                fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+                fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
                 exit(EXIT_FAILURE);
             case '?': // Unrecognized option
                 fprintf(stderr, "Unrecognized option: %c%c, arg: %d\n",
                         argv[optind - 1][0],argv[optind - 1][1], optind-1);
-                fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+                fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
                 exit(EXIT_FAILURE);
             default: // Unrecognized case in switch
                 fprintf(stderr, "Unrecognized case\n");
-                fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+                fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
                 exit(EXIT_FAILURE);
         }
     }
@@ -295,7 +788,7 @@ void parseInputArguments(int argc, char** argv, struct InputArguments * inputArg
     if(!cFlag || !pFlag || !dFlag)
     {
         fprintf(stderr, "Did not find required flags!\n");
-        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
         exit(EXIT_FAILURE);
     }
     parseInputAddr(argv, inputArguments);
@@ -303,34 +796,59 @@ void parseInputArguments(int argc, char** argv, struct InputArguments * inputArg
 
 void parseInputAddr(char ** argv, struct InputArguments * inputArguments)
 {
-    // Input addr is verified later by inet_aton (eg. if address is theoretically invalid, but goes through inet_aton - all is good
+    // Every argument left is a producent to balance between
     if(argv[optind] == NULL)
     {
-        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
         exit(EXIT_FAILURE);
     }
-    if(strchr(argv[optind], ':') == NULL)
+    for(inputArguments->endpointCount = 0; argv[optind] != NULL; optind++)
+    {
+        if(inputArguments->endpointCount == MAX_ENDPOINTS)
+        {
+            fprintf(stderr, "Too many producents (max %d).\n", MAX_ENDPOINTS);
+            exit(EXIT_FAILURE);
+        }
+        struct Endpoint * endpoint = &inputArguments->endpoints[inputArguments->endpointCount++];
+        memset(endpoint, 0, sizeof(*endpoint));
+        parseEndpoint(argv[optind], endpoint);
+    }
+}
+
+void parseEndpoint(char * arg, struct Endpoint * endpoint)
+{
+    // Input addr is verified later by inet_aton (eg. if address is theoretically invalid, but goes through inet_aton - all is good
+    if(strchr(arg, ':') == NULL)
     {
         // This means we use the default address
-        inputArguments->port = getInt(argv[optind]);
-        strcpy(inputArguments->locAddress, LOCALHOST);  // LOCALHOST == "127.0.0.1" [hope this is ok]
+        endpoint->port = getInt(arg);
+        strcpy(endpoint->locAddress, LOCALHOST);  // LOCALHOST == "127.0.0.1" [hope this is ok]
     }
     else
     {
         char *token;
-        token = strtok(argv[optind], ":");
+        token = strtok(arg, ":");
         if(strlen(token) < 7 || strlen(token) > 15)     // Not checking if eg. 1.11111.1.1 is invalid - it will go through inet_aton
         {
             fprintf(stderr, "Bad address.\n");
-            fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+            fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
             exit(EXIT_FAILURE);
         }
         if(strcmp(token, "localhost") == 0)
-            strcpy(inputArguments->locAddress, LOCALHOST);
+            strcpy(endpoint->locAddress, LOCALHOST);
         else
-            strncpy(inputArguments->locAddress, token, strlen(token));
+            strncpy(endpoint->locAddress, token, strlen(token));
         token = strtok(NULL, "");
-        inputArguments->port = (short) getInt(token);
+        endpoint->port = (short) getInt(token);
+    }
+
+    endpoint->sockAddr.sin_family = AF_INET;
+    endpoint->sockAddr.sin_port = htons(endpoint->port);
+    errno = 0;
+    if((inet_aton(endpoint->locAddress, &endpoint->sockAddr.sin_addr)) == 0)
+    {
+        perror("inet_aton couldn't parse provided address");
+        exit(EXIT_FAILURE);
     }
 }
 
@@ -345,13 +863,13 @@ double getFloat(char * arg)
     if (*endptr != '\0')
     {
         fprintf(stderr,"Non-numeric argument: %s, at %s, arg: %d\n", arg, endptr, optind-1);
-        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
         exit(EXIT_FAILURE);
     }
     if (res < 0)
     {
         fprintf(stderr,"Negative values not allowed\n");
-        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
         exit(EXIT_FAILURE);
     }
     return res;
@@ -368,13 +886,13 @@ int getInt(char * arg)
     if (*endptr != '\0')
     {
         fprintf(stderr,"Non-numeric argument: %s, at %s, arg: %d\n", arg, endptr, optind-1);
-        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
         exit(EXIT_FAILURE);
     }
     if (res < 0)
     {
         fprintf(stderr,"Negative values not allowed\n");
-        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
         exit(EXIT_FAILURE);
     }
     return res;
@@ -382,9 +900,9 @@ int getInt(char * arg)
 
 void checkArgCount(int argc, char ** argv)
 {
-    if((argc > 8 || argc < 5) || strcmp(argv[1], "--help") == 0)
+    if((argc > 15 + MAX_ENDPOINTS || argc < 5) || strcmp(argv[1], "--help") == 0)
     {
-        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -c <int> -p <float> -d <float> [-j <int>] [-m <linear|ttl|exp>] [-t <float>] [-o <path>] [<addr>:]port...\n");
         exit(EXIT_FAILURE);
     }
 }
\ No newline at end of file
@@ -0,0 +1,44 @@
+#include "adaptive.h"
+
+#define KP 0.4f                     // Proportional gain (fraction of the rate range per unit of error)
+#define KI 0.3f                     // Integral gain (per second)
+
+void controllerInit(struct RateController * controller, float rate, float minRate, float maxRate, int waitTarget)
+{
+    controller->minRate = minRate;
+    controller->maxRate = maxRate;
+    controller->rate = rate < minRate ? minRate : (rate > maxRate ? maxRate : rate);
+    controller->waitTarget = waitTarget;
+    controller->prevError = 0;
+}
+
+float controllerUpdate(struct RateController * controller, struct WorkerFeedback * feedback, double elapsed)
+{
+    // Positive error - produce more, negative - produce less. Roughly in [-1, 1].
+    float error;
+    if(feedback->queueDepth > 0)
+    {
+        // Clients are waiting for data: aim for half the SLO so spikes still fit under it
+        error = (float)feedback->oldestWait / (controller->waitTarget * 0.5f) - 1.0f;
+        if(error < 0.1f)            // Anybody waiting at all means demand > supply
+            error = 0.1f;
+        if(error > 2.0f)
+            error = 2.0f;
+    }
+    else
+    {
+        // Nobody waiting: keep a reserve for the next burst, don't fill the pipe and block on it
+        error = (FILL_TARGET - feedback->percentage) / FILL_TARGET;
+    }
+
+    if(elapsed > 1.0)               // Worker was blocked on a full pipe - don't integrate the whole stall
+        elapsed = 1.0;
+    float range = controller->maxRate - controller->minRate;
+    controller->rate += range * (KP * (error - controller->prevError) + KI * error * (float)elapsed);
+    controller->prevError = error;
+    if(controller->rate < controller->minRate)      // Clamping the output doubles as anti-windup
+        controller->rate = controller->minRate;
+    if(controller->rate > controller->maxRate)
+        controller->rate = controller->maxRate;
+    return controller->rate;
+}
@@ -0,0 +1,28 @@
+#ifndef MODELMIESZANY_ADAPTIVE_H
+#define MODELMIESZANY_ADAPTIVE_H
+
+#define FEEDBACK_INTERVAL 100       // ms between two feedback messages from the server to the worker
+#define FILL_TARGET 0.5f            // Storage fill the worker aims for when nobody is waiting
+
+// Server -> worker, over a non-blocking pipe (sizeof < PIPE_BUF, so writes are atomic)
+struct WorkerFeedback
+{
+    int queueDepth;
+    int oldestWait;                 // ms the oldest queued client has been waiting
+    float percentage;               // Storage fill
+};
+
+// PI controller (velocity form) keeping production between minRate and maxRate
+struct RateController
+{
+    float rate;
+    float minRate;
+    float maxRate;
+    int waitTarget;                 // Queue wait SLO in ms
+    float prevError;
+};
+
+void controllerInit(struct RateController *, float, float, float, int);
+float controllerUpdate(struct RateController *, struct WorkerFeedback *, double);
+
+#endif //MODELMIESZANY_ADAPTIVE_H
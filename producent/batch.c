@@ -0,0 +1,251 @@
+#include "batch.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int allocBatch(struct BatchPool *);
+static void freeBatch(struct BatchPool *, int);
+static void fillBatch(struct BatchPool *, struct StorageShards *, int, bool);
+static void pushReady(struct BatchPool *, int);
+static void readBatch(struct BatchPool *, int, int);
+
+void initBatchPool(struct BatchPool * pool, struct Batch * batches, char * data, int groupSize,
+                   void (*readStorage)(void *, int, char *, int), void * storageContext)
+{
+    // Zeroed batches - fresh pool, otherwise the pool of the process we took over from (bound and ready batches included)
+    pool->fd = -1;
+    pool->groupSize = groupSize;
+    pool->batches = batches;
+    pool->data = data;
+    pool->readStorage = readStorage;
+    pool->storageContext = storageContext;
+    pool->freeCount = 0;
+    pool->readyBatches = create(POOL_BATCHES);
+    pool->readySeq = 0;
+    pool->early = false;
+    pool->transferNs = 0;
+    for(int shard = 0; shard < MAX_SHARDS; shard++)
+        pool->filling[shard] = -1;
+    int ready[POOL_BATCHES];
+    int readyCount = 0;
+    for(int i = POOL_BATCHES - 1; i >= 0; i--)  // The lists are ours only - rebuild them from the batches
+    {
+        if(pool->batches[i].ready)
+        {
+            int j = readyCount++;               // Insertion sort - oldest first, as they were queued
+            for(; j > 0 && pool->batches[ready[j - 1]].readySeq > pool->batches[i].readySeq; j--)
+                ready[j] = ready[j - 1];
+            ready[j] = i;
+            if(pool->batches[i].readySeq >= pool->readySeq)
+                pool->readySeq = pool->batches[i].readySeq + 1;
+        }
+        else if(pool->batches[i].filling)
+            pool->filling[pool->batches[i].shard] = i;
+        else if(pool->batches[i].refCount == 0)
+            pool->freeList[pool->freeCount++] = i;
+    }
+    for(int i = 0; i < readyCount; i++)
+        push(pool->readyBatches, ready[i]);
+}
+
+static int allocBatch(struct BatchPool * pool)
+{
+    if(pool->freeCount == 0)            // Can't happen - bound batches <= polled clients, ready <= READY_BATCHES per shard
+    {
+        fprintf(stderr, "Batch pool exhausted\n");
+        exit(EXIT_FAILURE);
+    }
+    return pool->freeList[--pool->freeCount];
+}
+
+static void freeBatch(struct BatchPool * pool, int index)
+{
+    pool->freeList[pool->freeCount++] = index;
+}
+
+static void readBatch(struct BatchPool * pool, int index, int amount)
+{
+    // amount more bytes of the batch's shard right behind what it's been filled with
+    struct Batch * batch = &pool->batches[index];
+    pool->readStorage(pool->storageContext, batch->shard, pool->data ? batchData(pool, index) + batch->filled : NULL, amount);
+}
+
+char * batchData(struct BatchPool * pool, int index)
+{
+    return pool->data + (size_t)index * SEND_THRESHOLD;
+}
+
+static void pushReady(struct BatchPool * pool, int index)
+{
+    pool->batches[index].ready = true;
+    pool->batches[index].readySeq = pool->readySeq++;
+    push(pool->readyBatches, index);
+}
+
+void assembleBatches(struct BatchPool * pool, struct StorageShards * shards)
+{
+    // Drains every shard's storage into ready batches (one large sequential read each) up to READY_BATCHES
+    for(int shard = 0; shard < shards->count; shard++)
+    {
+        if(pool->filling[shard] != -1)
+        {
+            fillBatch(pool, shards, shard, false);
+            if(pool->filling[shard] != -1)      // The filling batch gets the shard's data first (in order)
+                continue;
+        }
+        while(canAssemble(&shards->storage[shard]))
+        {
+            int index = allocBatch(pool);
+            pool->batches[index].shard = shard;
+            pool->batches[index].sent = false;
+            pool->batches[index].filled = 0;
+            pool->batches[index].filling = false;
+            readBatch(pool, index, SEND_THRESHOLD);         // Overflow first, then the pipe
+            pool->batches[index].filled = SEND_THRESHOLD;
+            pushReady(pool, index);
+            cacheBatch(&shards->storage[shard]);
+            trace(TRACE_ASSEMBLE, shard, index);
+        }
+    }
+}
+
+int takeBatch(struct BatchPool * pool, struct StorageShards * shards)
+{
+    // Oldest ready batch leaves the storage, -1 if the storage can't fill one
+    if(getCurrentSize(pool->readyBatches) == 0)
+        assembleBatches(pool, shards);
+    if(getCurrentSize(pool->readyBatches) == 0)
+        return -1;
+    int index = pop(pool->readyBatches);
+    pool->batches[index].ready = false;
+    takeCachedBatch(&shards->storage[pool->batches[index].shard]);
+    return index;
+}
+
+void bindBatch(struct BatchPool * pool, int index)
+{
+    pool->batches[index].refCount++;
+}
+
+void releaseBatch(struct BatchPool * pool, struct StorageShards * shards, int index)
+{
+    // Last client done - the batch is recycled. Nothing sent from it yet - it goes back to the ready ones.
+    struct Batch * batch = &pool->batches[index];
+    if(--batch->refCount != 0)
+        return;
+    if(batch->filling)
+    {
+        if(!batch->sent)                // Stays the shard's filling batch, what's been read counts as storage again
+        {
+            returnCachedData(&shards->storage[batch->shard], batch->filled);
+            return;
+        }
+        pool->filling[batch->shard] = -1;   // The rest of it never left the pipe
+        batch->filling = false;
+        freeBatch(pool, index);
+        return;
+    }
+    if(!batch->sent)
+    {
+        pushReady(pool, index);
+        returnCachedBatch(&shards->storage[batch->shard]);
+    }
+    else
+        freeBatch(pool, index);
+}
+
+int batchesInUse(struct BatchPool * pool)
+{
+    return POOL_BATCHES - pool->freeCount - getCurrentSize(pool->readyBatches);
+}
+
+int takeEarlyBatch(struct BatchPool * pool, struct StorageShards * shards)
+{
+    // No ready batch (-e): bind a batch of the shard whose pipe contents plus what it's forecast to produce
+    // during one transfer cover a whole batch. The most data in hand wins. -1 if the forecast can't cover any.
+    if(!pool->early)
+        return -1;
+    int best = -1;
+    int bestData = -1;
+    for(int shard = 0; shard < shards->count; shard++)
+    {
+        int index = pool->filling[shard];
+        if(index != -1 && pool->batches[index].refCount != 0)  // One filling batch per shard
+            continue;
+        struct Storage * storage = &shards->storage[shard];
+        int inHand = storage->currentStorage - storage->cachedData + (index != -1 ? pool->batches[index].filled : 0);
+        if(canAdmitEarly(storage, inHand, pool->transferNs) && inHand > bestData)
+        {
+            best = shard;
+            bestData = inHand;
+        }
+    }
+    if(best == -1)
+        return -1;
+    int index = pool->filling[best];
+    if(index == -1)
+    {
+        index = allocBatch(pool);
+        pool->batches[index].shard = best;
+        pool->batches[index].ready = false;
+        pool->batches[index].sent = false;
+        pool->batches[index].filled = 0;
+        pool->batches[index].filling = true;
+        pool->filling[best] = index;
+    }
+    else                                // Left by its clients before a byte was sent - it leaves the storage again
+        takeCachedData(&shards->storage[best], pool->batches[index].filled);
+    fillBatch(pool, shards, best, true);      // Bound by the caller - nothing of it is storage anymore
+    return index;
+}
+
+static void fillBatch(struct BatchPool * pool, struct StorageShards * shards, int shard, bool binding)
+{
+    // Whatever the storage holds now goes into the shard's filling batch - never waits for more.
+    // Complete and nobody bound (or being bound) to it - it's an ordinary ready batch.
+    int index = pool->filling[shard];
+    struct Batch * batch = &pool->batches[index];
+    bool bound = binding || batch->refCount != 0;
+    struct Storage * storage = &shards->storage[shard];
+    int wanted = SEND_THRESHOLD - batch->filled;
+    if(wanted > storage->currentStorage - storage->cachedData)
+        wanted = storage->currentStorage - storage->cachedData;
+    if(wanted > 0)                      // The storage holds at least that much (FIONREAD) and we're the only reader
+    {
+        readBatch(pool, index, wanted);
+        if(bound)
+            drainStorage(storage, wanted);
+        else
+            cacheData(storage, wanted);
+        batch->filled += wanted;
+    }
+    if(batch->filled < SEND_THRESHOLD)
+        return;
+    batch->filling = false;
+    pool->filling[shard] = -1;
+    trace(TRACE_ASSEMBLE, shard, index);
+    if(!bound)
+        pushReady(pool, index);
+}
+
+void recordTransfer(struct BatchPool * pool, long long transferNs)
+{
+    // Whole batches sent from memory only - what an early admission has to forecast the production over
+    pool->transferNs = averageTransfer(pool->transferNs, transferNs);
+}
+
+int fillWait(struct BatchPool * pool, struct StorageShards * shards, int pollWait)
+{
+    // A bound batch is filling - poll no longer than its shard takes to produce another block
+    for(int shard = 0; shard < shards->count; shard++)
+    {
+        int index = pool->filling[shard];
+        if(index == -1 || pool->batches[index].refCount == 0 || shards->storage[shard].inflowRate <= 0)
+            continue;
+        int blockMs = (int)(BLOCK_SIZE / shards->storage[shard].inflowRate) + 1;
+        if(blockMs < pollWait)
+            pollWait = blockMs;
+    }
+    return pollWait;
+}
@@ -0,0 +1,54 @@
+#ifndef MODELMIESZANY_BATCH_H
+#define MODELMIESZANY_BATCH_H
+
+#include <stdbool.h>
+
+#include "buffer.h"
+#include "storage.h"
+
+#define POOL_BATCHES (MAX_CLIENTS + READY_BATCHES * MAX_SHARDS)    // Bound to a client + ready in every shard
+
+// A whole batch taken out of the storage with one large read, every client bound to it is sent it from memory.
+// With -b a batch is bound to (broadcast to) up to groupSize clients.
+// This is the pool's bookkeeping only - the server keeps it in a memfd (batchfile.c) next to the batch data,
+// the simulator in plain memory without any data. Storage is read through the pool's readStorage.
+struct Batch
+{
+    int refCount;                   // Clients being sent this batch
+    bool ready;                     // Assembled, not bound yet (still counted in its shard's storage)
+    bool sent;                      // Some client got bytes of it - it can't go back to the storage
+    int shard;                      // Storage it was taken from
+    int filled;                     // Bytes read into it - SEND_THRESHOLD unless it's still filling
+    bool filling;                   // Bound early (-e), the rest is read from the pipe as the worker produces it
+    long long readySeq;             // Order it was queued as ready in - the queue is rebuilt by it after a handoff
+};
+
+struct BatchPool
+{
+    int fd;                         // memfd the batches live in (travels with the handoff), -1 - none
+    int groupSize;                  // Max clients bound to one batch
+    struct Batch * batches;         // POOL_BATCHES of them
+    char * data;                    // SEND_THRESHOLD bytes per batch, NULL - bookkeeping only
+    void (*readStorage)(void *, int, char *, int);     // Oldest amount bytes of a shard into data (NULL - nowhere)
+    void * storageContext;          // readStorage's first argument
+    int freeList[POOL_BATCHES];     // Stack - the most recently freed (cache-warm) batch is reused first
+    int freeCount;
+    struct buffer * readyBatches;   // Assembled batches, oldest first
+    long long readySeq;             // Next ready batch's readySeq
+    bool early;                     // -e, a batch can be bound before its shard has produced all of it
+    int filling[MAX_SHARDS];        // The filling batch of every shard, -1 - none (the pipe data goes to it first)
+    long long transferNs;           // Admission - last byte of a whole batch (EWMA), 0 - not measured yet
+};
+
+void initBatchPool(struct BatchPool *, struct Batch *, char *, int, void (*)(void *, int, char *, int), void *);
+char * batchData(struct BatchPool *, int);
+void assembleBatches(struct BatchPool *, struct StorageShards *);
+int takeBatch(struct BatchPool *, struct StorageShards *);
+void bindBatch(struct BatchPool *, int);
+void releaseBatch(struct BatchPool *, struct StorageShards *, int);
+int batchesInUse(struct BatchPool *);
+int takeEarlyBatch(struct BatchPool *, struct StorageShards *);
+void recordTransfer(struct BatchPool *, long long);
+int fillWait(struct BatchPool *, struct StorageShards *, int);
+
+#endif //MODELMIESZANY_BATCH_H
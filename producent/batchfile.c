@@ -0,0 +1,46 @@
+#define _GNU_SOURCE
+
+#include "batchfile.h"
+#include "overflow.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static void readShard(void *, int, char *, int);
+
+void setupBatchPool(struct BatchPool * pool, int fd, int groupSize, struct StorageShards * shards)
+{
+    // fd == -1 - fresh pool, otherwise the pool of the process we took over from (bound and ready batches included)
+    if(fd == -1)
+    {
+        errno = 0;
+        if((fd = memfd_create("bfi-batches", 0)) == -1)
+        {
+            perror("memfd_create");
+            exit(EXIT_FAILURE);
+        }
+        errno = 0;
+        if(ftruncate(fd, POOL_SIZE) == -1)      // Zero filled - every batch starts free
+        {
+            perror("ftruncate batch pool");
+            exit(EXIT_FAILURE);
+        }
+    }
+    errno = 0;
+    char * memory = mmap(NULL, POOL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(memory == MAP_FAILED)
+    {
+        perror("mmap batch pool");
+        exit(EXIT_FAILURE);
+    }
+    initBatchPool(pool, (struct Batch *)memory, memory + POOL_DATA_OFFSET, groupSize, readShard, shards);
+    pool->fd = fd;
+}
+
+static void readShard(void * shards, int shard, char * data, int amount)
+{
+    readStorage(shards, shard, data, amount);       // Overflow first, then the pipe
+}
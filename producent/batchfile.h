@@ -0,0 +1,13 @@
+#ifndef MODELMIESZANY_BATCHFILE_H
+#define MODELMIESZANY_BATCHFILE_H
+
+#include "batch.h"
+
+// The server's batch pool lives in a memfd: the bookkeeping (batch.h) first, the batch data from the next page on.
+// The memfd travels with the handoff, so the new process sends the very same batches.
+#define POOL_DATA_OFFSET ((POOL_BATCHES * sizeof(struct Batch) + 4095) & ~(size_t)4095)
+#define POOL_SIZE (POOL_DATA_OFFSET + (size_t)POOL_BATCHES * SEND_THRESHOLD)
+
+void setupBatchPool(struct BatchPool *, int, int, struct StorageShards *);
+
+#endif //MODELMIESZANY_BATCHFILE_H
@@ -43,6 +43,10 @@ int pop(struct buffer* buffer)
 
     return dummy;
 }
+int peek(struct buffer* buffer)
+{
+    return buffer->buffer[buffer->first];
+}
 int getCurrentSize(struct buffer* buffer)
 {
     return buffer->currentSize;
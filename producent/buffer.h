@@ -21,6 +21,7 @@ struct buffer* create(int size);
 void delete(struct buffer* buffer);
 int push(struct buffer* buffer, int element);
 int pop(struct buffer* buffer);
+int peek(struct buffer* buffer);
 int getCurrentSize(struct buffer* buffer);
 bool isFull(struct buffer * buffer);
 
@@ -0,0 +1,23 @@
+#include "clienttable.h"
+
+int addClient(struct ClientTable * table, int fd, int batch, int alreadySent)
+{
+    // Index of the new client - only valid until a client before it is removed
+    int index = table->count++;
+    table->pollFD[POLL_FIXED + index] = (struct pollfd){.fd = fd, .events = POLLOUT | POLLHUP, .revents = 0};
+    table->alreadySent[index] = alreadySent;
+    table->batch[index] = batch;
+    return index;
+}
+
+void removeClient(struct ClientTable * table, int index)
+{
+    // The last client takes the freed place (revents included - a loop going backwards has already handled it)
+    int last = --table->count;
+    if(index == last)
+        return;
+    table->pollFD[POLL_FIXED + index] = table->pollFD[POLL_FIXED + last];
+    table->alreadySent[index] = table->alreadySent[last];
+    table->batch[index] = table->batch[last];
+    table->cold[index] = table->cold[last];
+}
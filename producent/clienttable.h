@@ -0,0 +1,41 @@
+#ifndef MODELMIESZANY_CLIENTTABLE_H
+#define MODELMIESZANY_CLIENTTABLE_H
+
+#include <poll.h>
+#include <netinet/in.h>
+
+#include "storage.h"
+#include "../histogram.h"
+
+// The poll array starts with the fixed descriptors, the polled clients follow densely (client i is at POLL_FIXED + i)
+#define POLL_SERVER 0
+#define POLL_TIMER 1
+#define POLL_UPGRADE 2              // -1 without -u
+#define POLL_STATUS 3
+#define POLL_FIXED 4
+
+struct ClientCold                   // Only read for the reports and the handoff
+{
+    struct sockaddr_in sockAddr;
+    long long admittedNs;           // CLOCK_MONOTONIC ns the client got its batch
+    bool early;                     // Admitted to a filling batch (-e)
+};
+
+// Polled clients, struct of arrays - the send loop only touches the pollfd, alreadySent and batch of a client.
+// Always dense: a client is added at the end and removed by moving the last one into its place, so admission and
+// release are O(1) and poll() and every loop only see the active clients.
+struct ClientTable
+{
+    struct pollfd pollFD[POLL_FIXED + MAX_CLIENTS];
+    int alreadySent[MAX_CLIENTS];
+    int batch[MAX_CLIENTS];         // Batch the client is sent (index in the batch pool)
+    struct ClientCold cold[MAX_CLIENTS];
+    int count;
+    struct Histogram queueWait;     // Accepted - admitted, since the last interval report
+    struct Histogram firstByte;     // Admitted - first byte sent, since the last interval report
+};
+
+int addClient(struct ClientTable *, int, int, int);
+void removeClient(struct ClientTable *, int);
+
+#endif //MODELMIESZANY_CLIENTTABLE_H
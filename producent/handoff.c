@@ -0,0 +1,161 @@
+#include "handoff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define ACK_WAIT 1000           // ms the old process waits for the new one to confirm the takeover
+
+static void fillUnixAddress(struct sockaddr_un * address, const char * path)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strncpy(address->sun_path, path, sizeof(address->sun_path) - 1);
+}
+
+int setupUpgradeListener(const char * path)
+{
+    // The next process to start with the same -u path connects here and takes everything over
+    struct sockaddr_un address;
+    fillUnixAddress(&address, path);
+
+    errno = 0;
+    int upgradeFd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(upgradeFd == -1)
+    {
+        perror("creating upgrade socket");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);                   // Left behind by the process we took over from (or a crashed one)
+    errno = 0;
+    if(bind(upgradeFd, (struct sockaddr*) &address, sizeof(address)) == -1)
+    {
+        perror("bind upgrade socket");
+        exit(EXIT_FAILURE);
+    }
+    errno = 0;
+    if(listen(upgradeFd, 1) == -1)
+    {
+        perror("listen upgrade socket");
+        exit(EXIT_FAILURE);
+    }
+    return upgradeFd;
+}
+
+bool handOver(int upgradeFd, struct HandoffState * state, int * fds, int fdCount)
+{
+    // Returns true once the new process confirmed it owns the descriptors - the caller can exit then.
+    // On false the caller still holds every descriptor and just keeps serving.
+    errno = 0;
+    int newProcessFd = accept(upgradeFd, NULL, NULL);
+    if(newProcessFd == -1)
+    {
+        perror("accept upgrade");
+        return false;
+    }
+
+    state->magic = HANDOFF_MAGIC;
+    state->stateSize = sizeof(struct HandoffState);
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = state, .iov_len = sizeof(struct HandoffState)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control, .msg_controllen = CMSG_SPACE(sizeof(int) * fdCount)};
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+
+    errno = 0;
+    if(sendmsg(newProcessFd, &message, 0) == -1)
+    {
+        perror("sendmsg handoff");
+        close(newProcessFd);
+        return false;
+    }
+
+    struct pollfd ackPoll = {.fd = newProcessFd, .events = POLLIN};
+    char ack = 0;
+    if(poll(&ackPoll, 1, ACK_WAIT) != 1 || read(newProcessFd, &ack, 1) != 1)
+    {
+        fprintf(stderr, "New process did not confirm the takeover, carrying on.\n");
+        close(newProcessFd);
+        return false;
+    }
+    close(newProcessFd);
+    return true;
+}
+
+bool takeOver(const char * path, struct HandoffState * state, int * fds, int * fdCount)
+{
+    // Returns false if there is no process to take over from (fresh start)
+    struct sockaddr_un address;
+    fillUnixAddress(&address, path);
+
+    errno = 0;
+    int oldProcessFd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(oldProcessFd == -1)
+    {
+        perror("creating upgrade socket");
+        exit(EXIT_FAILURE);
+    }
+    errno = 0;
+    if(connect(oldProcessFd, (struct sockaddr*) &address, sizeof(address)) == -1)
+    {
+        if(errno != ENOENT && errno != ECONNREFUSED)
+            perror("connecting to the old process");
+        close(oldProcessFd);
+        return false;
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = {.iov_base = state, .iov_len = sizeof(struct HandoffState)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control, .msg_controllen = sizeof(control)};
+    errno = 0;
+    ssize_t received = recvmsg(oldProcessFd, &message, 0);
+    if(received == -1)
+    {
+        perror("recvmsg handoff");
+        exit(EXIT_FAILURE);
+    }
+    if(received != sizeof(struct HandoffState) || state->magic != HANDOFF_MAGIC
+       || state->stateSize != sizeof(struct HandoffState) || (message.msg_flags & (MSG_TRUNC|MSG_CTRUNC)))
+    {
+        fprintf(stderr, "Handoff from an incompatible producent build.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    *fdCount = 0;
+    for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            *fdCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (*fdCount));
+        }
+    }
+    if(state->shardCount < 1 || state->shardCount > MAX_SHARDS
+       || *fdCount != 3 + state->shardCount * (1 + state->hasControl) + state->hasOverflow + state->queuedCount + state->polledCount)
+    {
+        fprintf(stderr, "Handoff descriptor count mismatch: %d\n", *fdCount);
+        exit(EXIT_FAILURE);
+    }
+
+    char ack = 1;           // Old process exits after this
+    errno = 0;
+    if(write(oldProcessFd, &ack, 1) == -1)
+    {
+        perror("write handoff ack");
+        exit(EXIT_FAILURE);
+    }
+    close(oldProcessFd);
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef MODELMIESZANY_HANDOFF_H
+#define MODELMIESZANY_HANDOFF_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "storage.h"
+
+#define HANDOFF_MAGIC 0x42464931        // "BFI1"
+#define HANDOFF_MAX_FDS (MAX_CLIENTS+4+2*MAX_SHARDS)    // serverFD + statusFD + pipeRead and controlWrite of every shard
+                                                        // + batch pool + overflow + every client (queued + polled <= MAX_CLIENTS)
+
+struct ClientTransferData
+{
+    int alreadySent;
+    int batch;                  // Batch the client is sent (index in the batch pool)
+    struct sockaddr_in sockAddr;
+    long long admittedNs;       // CLOCK_MONOTONIC ns the client got its batch (system wide - carries on)
+    bool early;                 // Admitted to a filling batch (-e)
+};
+
+// Everything the new process needs besides the descriptors themselves.
+// Descriptors travel as SCM_RIGHTS in this order: serverFD, statusFD, pipeRead of every shard, [controlWrite of every shard],
+// batch pool, [overflow file], queued clients, polled clients.
+struct HandoffState
+{
+    int magic;
+    int stateSize;
+    int shardCount;
+    struct Storage storage[MAX_SHARDS];
+    int hasControl;                                         // Adaptive workers - their feedback pipes are passed too
+    int hasOverflow;                                        // Overflow tier (-o) - its file is passed too
+    int highWater;                                          // -H
+    int groupSize;                                          // Clients bound to one batch (-b)
+    int queuedCount;
+    int queueTimes[MAX_CLIENTS];                            // Enqueue timestamps (ms, CLOCK_MONOTONIC) of the queued clients
+    int polledCount;
+    struct ClientTransferData clientData[MAX_CLIENTS];     // Only the polled clients, same order as their FDs
+};
+
+int setupUpgradeListener(const char *);
+bool handOver(int, struct HandoffState *, int *, int);
+bool takeOver(const char *, struct HandoffState *, int *, int *);
+
+#endif //MODELMIESZANY_HANDOFF_H
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include "overflow.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static struct OverflowSegment * segmentOf(struct StorageShards *, int);
+static char * dataOf(struct StorageShards *, int);
+
+void setupOverflow(struct StorageShards * shards, const char * path, int fd)
+{
+    // fd == -1 - fresh (empty) segments in the file at path, otherwise the file of the process we took over from
+    if(fd == -1)
+    {
+        errno = 0;
+        if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1)
+        {
+            perror("open overflow file");
+            exit(EXIT_FAILURE);
+        }
+        errno = 0;
+        if(ftruncate(fd, (off_t)OVERFLOW_SHARD * MAX_SHARDS) == -1)     // Sparse, zero filled - every segment starts empty
+        {
+            perror("ftruncate overflow file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    errno = 0;
+    void * overflow = mmap(NULL, (size_t)OVERFLOW_SHARD * MAX_SHARDS, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(overflow == MAP_FAILED)
+    {
+        perror("mmap overflow file");
+        exit(EXIT_FAILURE);
+    }
+    madvise(overflow, (size_t)OVERFLOW_SHARD * MAX_SHARDS, MADV_SEQUENTIAL);     // Only a hint - appended and served in order
+    shards->overflow = overflow;
+    shards->overflowFd = fd;
+}
+
+static struct OverflowSegment * segmentOf(struct StorageShards * shards, int shard)
+{
+    return (struct OverflowSegment *)(shards->overflow + (size_t)OVERFLOW_SHARD * shard);
+}
+
+static char * dataOf(struct StorageShards * shards, int shard)
+{
+    return shards->overflow + (size_t)OVERFLOW_SHARD * shard + OVERFLOW_HEADER;
+}
+
+void spillOverflow(struct StorageShards * shards)
+{
+    // Every shard above the high-water mark: the pipe's surplus is appended to its segment.
+    // A full segment leaves the surplus in the pipe.
+    if(shards->overflow == NULL)
+        return;
+    for(int shard = 0; shard < shards->count; shard++)
+    {
+        struct Storage * storage = &shards->storage[shard];
+        struct OverflowSegment * segment = segmentOf(shards, shard);
+        int surplus = spillSurplus(storage, shards->highWater, OVERFLOW_SEGMENT - segment->tail);
+        if(surplus == 0)
+            continue;
+        for(int spilled = 0; spilled < surplus;)    // The pipe holds at least that much and we're its only reader
+        {
+            errno = 0;
+            int num = read(shards->pipeRead[shard], dataOf(shards, shard) + segment->tail, surplus - spilled);
+            if(num == -1)
+            {
+                perror("read pipe into overflow");
+                exit(EXIT_FAILURE);
+            }
+            segment->tail += num;
+            spilled += num;
+        }
+        storage->overflowData += surplus;       // Moved from the pipe to the overflow - still in the storage
+        storage->drained += surplus;
+    }
+}
+
+void readStorage(struct StorageShards * shards, int shard, char * data, int amount)
+{
+    // amount bytes of the shard's oldest data: the overflow segment first, then the pipe (the caller made sure it's there)
+    struct Storage * storage = &shards->storage[shard];
+    if(storage->overflowData > 0)
+    {
+        struct OverflowSegment * segment = segmentOf(shards, shard);
+        char * segmentData = dataOf(shards, shard);
+        int fromOverflow = amount < segment->tail - segment->head ? amount : segment->tail - segment->head;
+        memcpy(data, segmentData + segment->head, fromOverflow);
+        segment->head += fromOverflow;
+        storage->overflowData -= fromOverflow;
+        data += fromOverflow;
+        amount -= fromOverflow;
+        if(segment->head == segment->tail)      // Served - rewind, the disk space goes back to the file system
+        {
+            errno = 0;
+            if(fallocate(shards->overflowFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         (off_t)OVERFLOW_SHARD * shard + OVERFLOW_HEADER, segment->tail) == -1 && errno != EOPNOTSUPP)
+                perror("fallocate overflow");   // Not fatal - the pages are just reused
+            segment->head = segment->tail = 0;
+        }
+        else                                    // Page in what the next batches are going to need
+        {
+            char * next = segmentData + (segment->head & ~(OVERFLOW_HEADER - 1));
+            madvise(next, OVERFLOW_READAHEAD, MADV_WILLNEED);
+        }
+    }
+    while(amount > 0)
+    {
+        errno = 0;
+        int num = read(shards->pipeRead[shard], data, amount);
+        if(num == -1)
+        {
+            perror("read storage pipe");
+            exit(EXIT_FAILURE);
+        }
+        data += num;
+        amount -= num;
+        storage->drained += num;
+    }
+}
+
+int overflowCapacity(struct StorageShards * shards)
+{
+    return shards->overflow == NULL ? 0 : shards->count * OVERFLOW_SEGMENT;
+}
@@ -0,0 +1,27 @@
+#ifndef MODELMIESZANY_OVERFLOW_H
+#define MODELMIESZANY_OVERFLOW_H
+
+#include "storage.h"
+
+#define OVERFLOW_SEGMENT (64 << 20)         // Bytes of overflow per shard (the file is sparse)
+#define OVERFLOW_HEADER 4096                // Page in front of every segment with its offsets
+#define OVERFLOW_SHARD (OVERFLOW_HEADER + OVERFLOW_SEGMENT)
+#define OVERFLOW_READAHEAD (4 * SEND_THRESHOLD)     // Read ahead of the segment's head while it's served
+#define HIGH_WATER 75                       // Default -H
+
+// Overflow tier (-o): once a shard's primary storage (pipe + ready batches) passes the high-water mark the server
+// appends the pipe's surplus to the shard's segment of a mmap'd file, so the worker never blocks on a full pipe.
+// The segment is older data than the pipe - it's served first, sequentially, and rewound once it's empty.
+// The offsets live in the file, so the segments travel with the handoff like the batch pool.
+struct OverflowSegment
+{
+    int head;                       // Next byte to serve
+    int tail;                       // Next byte to append
+};
+
+void setupOverflow(struct StorageShards *, const char *, int);
+void spillOverflow(struct StorageShards *);
+void readStorage(struct StorageShards *, int, char *, int);
+int overflowCapacity(struct StorageShards *);
+
+#endif //MODELMIESZANY_OVERFLOW_H
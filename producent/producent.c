@@ -10,24 +10,31 @@
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <time.h>
-#include <sys/poll.h>
 #include <sys/timerfd.h>
 #include <signal.h>
-#include <bits/signum.h>
+#include <sched.h>
 
 #include "buffer.h"
+#include "storage.h"
+#include "handoff.h"
+#include "adaptive.h"
+#include "batch.h"
+#include "batchfile.h"
+#include "clienttable.h"
+#include "trace.h"
+#include "overflow.h"
+#include "../status.h"
+#include "../histogram.h"
 
-#define BASE_RATE 2662
-#define BLOCK_SIZE 650
 #define LOCALHOST "127.0.0.1"
-#define MAX_CLIENTS 100
-#define PACKAGE_SIZE 4096
-#define SEND_THRESHOLD 13312
 #define POLL_WAIT 100
+#define BUSY_POLL_US 50         // SO_BUSY_POLL budget on client sockets in the low-latency mode (-P)
 
 struct Server {
     int socketFd;
+    int statusFd;               // UDP on the same port - answers konsument's load queries
     struct sockaddr_in sockAddr;
+    int busyPoll;               // SO_BUSY_POLL (us) for accepted clients, 0 - off
 };
 
 struct InputArguments
@@ -35,45 +42,63 @@ struct InputArguments
     float productionRate;
     char locAddress[16];
     size_t port;
-};
-
-struct ClientTransferData
-{
-    int alreadySent;
-    struct sockaddr_in sockAddr;
-};
-
-struct Storage
-{
-    int currentStorage;
-    int prevStorage;        // Stored to compare in the 5 sec intervals
-    int reservedData;
-    int freeData;
-    float percentage;
+    char upgradePath[108];      // sizeof(sockaddr_un.sun_path), empty if -u wasn't given
+    bool adaptive;              // -a <min>:<max> given
+    float minRate;
+    float maxRate;
+    int waitTarget;             // Queue wait SLO in ms (-l)
+    int workerCount;            // -w, one storage shard per worker
+    int groupSize;              // -b, clients bound to one batch (broadcast), 1 - every client gets its own
+    int serverCpu;              // -P, CPU the server loop is pinned to, -1 - not pinned (low-latency mode off)
+    int workerCpu;              // -P, worker i is pinned to workerCpu + i
+    bool spin;                  // -s, poll without a timeout instead of sleeping in it
+    bool early;                 // -e, admit a client once the storage plus the production forecast covers a batch
+    char * overflowPath;        // -o, overflow segment file, NULL - no overflow tier
+    int highWater;              // -H, primary storage fill (%) above which production spills into the overflow
+    char * tracePrefix;         // -T, lifecycle trace dumped to <prefix>.<pid>.json at exit, NULL - tracing off
 };
 
 void parseInputArguments(int, char**, struct InputArguments *);
 void checkArgCount(int, char**);
 void parseInputAddr(char**, struct InputArguments *);
-int setupStorage(float);
+void parseRateBounds(char *, struct InputArguments *);
+void parseCpus(char *, struct InputArguments *);
+void checkCpus(struct InputArguments *);
+void pinToCpu(int);
+void setBusyPoll(int, int);
+void setupStorage(struct InputArguments *, struct StorageShards *);
 void setupServer(struct Server *, struct InputArguments *);
-void trainPeon(int*, float);
-void workWork(float, int);
-void setupPollFD(struct pollfd *, struct Server);
-void pollTheFDs(struct pollfd *, struct buffer *, struct ClientTransferData *, struct Storage *, int *, struct Server *, int);
+void trainPeon(int*, int*, struct InputArguments *, struct StorageShards *);
+void workWork(struct InputArguments *, int, int, int);
+char nextBlock(char *, char);
+void adaptiveSleep(struct RateController *, int, struct timespec *, struct timespec *);
+void waitForPipe(struct RateController *, int, int, struct timespec *, struct timespec *);
+void readFeedback(struct RateController *, int, struct timespec *, struct timespec *);
+void sendFeedback(struct buffer *, struct buffer *, struct StorageShards *, int *);
+int monotonicMs(void);
+long long monotonicNs(void);
+void setupPollFD(struct pollfd *, struct Server, int);
+void restoreHandoff(struct HandoffState *, int *, struct ClientTable *, struct buffer *, struct buffer *, struct StorageShards *);
+void admitClient(struct ClientTable *, struct buffer *, struct buffer *, int, bool);
+void wakeStarved(struct ClientTable *, struct BatchPool *);
+void dropClient(struct ClientTable *, int, struct StorageShards *, struct BatchPool *);
+void pollTheFDs(struct ClientTable *, struct buffer *, struct buffer *, struct StorageShards *, struct BatchPool *, struct Server *, int);
 void updateStorage(struct Storage *, int);
-void pollClients(int *, struct pollfd *, struct ClientTransferData *, int, struct Storage *, int *);
-void pollServer(struct pollfd *, struct buffer *, const int *, int *, struct Server *);
-void pollTimer(struct pollfd *, struct buffer *, struct Storage *, const int *);
+void updateShards(struct StorageShards *);
+void pollClients(int *, struct ClientTable *, struct StorageShards *, struct BatchPool *);
+void pollServer(struct ClientTable *, struct buffer *, struct buffer *, int *, struct Server *);
+void pollTimer(struct ClientTable *, struct buffer *, struct StorageShards *, struct BatchPool *);
+void pollUpgrade(struct ClientTable *, struct buffer *, struct buffer *, struct StorageShards *, struct BatchPool *, struct Server *);
+void pollStatus(struct ClientTable *, struct buffer *, struct StorageShards *);
 
-void parseTime(float, struct timespec *);
 int getInt(char * arg);
 double getFloat(char * arg);
 
-void clientDisconnectReport(struct ClientTransferData clientData);
-void intervalReport(int, int, struct Storage );
+void clientDisconnectReport(struct ClientTable *, int);
+void intervalReport(struct ClientTable *, int, struct StorageShards *, struct BatchPool *);
 
 
+#ifndef PRODUCENT_NO_MAIN           // The benchmarks link the rest of this file
 int main(int argc, char** argv)
 {
     signal(SIGCHLD, SIG_IGN);
@@ -81,78 +106,263 @@ int main(int argc, char** argv)
     struct Server server;
     struct InputArguments inputArguments;
     parseInputArguments(argc, argv, &inputArguments);
-    int pipeRead = setupStorage(inputArguments.productionRate);
-    setupServer(&server, &inputArguments);
-    struct pollfd pollFD[MAX_CLIENTS+2];        // MAX_CLIENTS + serverFD + timerFD
-    setupPollFD(pollFD, server);
-
-    struct ClientTransferData clientData[MAX_CLIENTS];
-    int clientDataSize = 0;
+    if(inputArguments.tracePrefix != NULL)      // Before the workers are forked - they trace too
+        traceInit(inputArguments.tracePrefix, "producent");
+    struct ClientTable clientTable = {};        // serverFD + timerFD + upgradeFD + statusFD, then the polled clients
+    histogramInit(&clientTable.queueWait, "queueWait");
+    histogramInit(&clientTable.firstByte, "firstByte");
     struct buffer* clientQueue = create(MAX_CLIENTS);
-    struct Storage storage;
+    struct buffer* queueTimes = create(MAX_CLIENTS);     // Enqueue time of every queued client (same order)
+    struct StorageShards shards = {};                   // Storage pipe (+ feedback pipe) of every worker
+    struct BatchPool batchPool;                         // Batches assembled out of the storage and bound to clients
+    int lastFeedback = monotonicMs();
+
+    // With -u: take the listener, clients and storage over from a running producent (if there is one)
+    struct HandoffState handoffState;
+    int handoffFds[HANDOFF_MAX_FDS];
+    int handoffFdCount = 0;
+    bool tookOver = inputArguments.upgradePath[0] != '\0'
+                    && takeOver(inputArguments.upgradePath, &handoffState, handoffFds, &handoffFdCount);
+    if(tookOver)
+    {
+        server.socketFd = handoffFds[0];        // Workers keep running, their pipes are ours now
+        server.statusFd = handoffFds[1];
+        shards.count = handoffState.shardCount;
+        for(int i = 0; i < shards.count; i++)
+        {
+            shards.pipeRead[i] = handoffFds[2 + i];
+            shards.controlWrite[i] = handoffState.hasControl ? handoffFds[2 + shards.count + i] : -1;
+        }
+        // Ready batches and the ones still being sent come along
+        setupBatchPool(&batchPool, handoffFds[2 + shards.count * (1 + handoffState.hasControl)], handoffState.groupSize, &shards);
+        if(handoffState.hasOverflow)            // So does the overflow (and its high-water mark)
+        {
+            setupOverflow(&shards, NULL, handoffFds[3 + shards.count * (1 + handoffState.hasControl)]);
+            shards.highWater = handoffState.highWater;
+        }
+    }
+    else
+    {
+        setupStorage(&inputArguments, &shards);
+        setupServer(&server, &inputArguments);
+        setupBatchPool(&batchPool, -1, inputArguments.groupSize, &shards);
+    }
+    batchPool.early = inputArguments.early;
+    if(shards.overflow == NULL && inputArguments.overflowPath != NULL)
+    {
+        setupOverflow(&shards, inputArguments.overflowPath, -1);
+        shards.highWater = inputArguments.highWater;
+    }
+    server.busyPoll = 0;
+    if(inputArguments.serverCpu != -1)          // Low-latency mode - workers are pinned by now (or by our predecessor)
+    {
+        pinToCpu(inputArguments.serverCpu);
+        server.busyPoll = BUSY_POLL_US;
+    }
+    int upgradeFd = -1;
+    if(inputArguments.upgradePath[0] != '\0')
+        upgradeFd = setupUpgradeListener(inputArguments.upgradePath);     // For the process that replaces us
+    setupPollFD(clientTable.pollFD, server, upgradeFd);
+    if(tookOver)
+        restoreHandoff(&handoffState, handoffFds, &clientTable, clientQueue, queueTimes, &shards);
 
     while(1)
     {
-        updateStorage(&storage, pipeRead);
-        while(storage.freeData >= SEND_THRESHOLD && getCurrentSize(clientQueue) != 0)   // Adds clients to the poll
+        if(traceStopped())          // SIGINT/SIGTERM with -T - the trace is dumped at exit
+            exit(EXIT_SUCCESS);
+        updateShards(&shards);
+        int batch;
+        while(getCurrentSize(clientQueue) != 0 && ((batch = takeBatch(&batchPool, &shards)) != -1
+                                                   || (batch = takeEarlyBatch(&batchPool, &shards)) != -1))   // Adds clients to the poll
         {
-            for(int i = 0; i < MAX_CLIENTS; i++)
+            // The batch leaves the storage once, the whole group (one client without -b) is sent it from memory
+            for(int bound = 0; bound < batchPool.groupSize && getCurrentSize(clientQueue) != 0; bound++)
             {
-                if(pollFD[i].fd == -1)
-                {
-                    pollFD[i].fd = pop(clientQueue);    // This adds the client to poll (should always succeed)
-                    clientDataSize++;                   // Update clientStructure data to reflect the pollFD structure
-                    clientData[i].alreadySent = 0;
-                    socklen_t addressLength = sizeof(clientData->sockAddr);
-                    // Need to get the address before potential DC from the client (to report)
-                    if((getpeername(pollFD[i].fd, (struct sockaddr*) &clientData->sockAddr, &addressLength)) == -1)
-                    {
-                        perror("getpeername");
-                        exit(EXIT_FAILURE);
-                    }
-
-                    storage.freeData -= SEND_THRESHOLD;          // Allocating storage data
-                    storage.reservedData += SEND_THRESHOLD;      //
-                    break;
-                }
+                admitClient(&clientTable, clientQueue, queueTimes, batch, batchPool.batches[batch].filling);
+                bindBatch(&batchPool, batch);
             }
         }
-        pollTheFDs(pollFD, clientQueue, clientData, &storage, &clientDataSize, &server, pipeRead);
+        assembleBatches(&batchPool, &shards);           // Ready batches for the next admissions, filling batches first
+        spillOverflow(&shards);                         // Whatever is left above the high-water mark
+        wakeStarved(&clientTable, &batchPool);
+        sendFeedback(clientQueue, queueTimes, &shards, &lastFeedback);
+        pollTheFDs(&clientTable, clientQueue, queueTimes, &shards, &batchPool, &server,
+                   inputArguments.spin ? 0 : fillWait(&batchPool, &shards, POLL_WAIT));
+    }
+}
+#endif
+
+void admitClient(struct ClientTable * table, struct buffer * clientQueue, struct buffer * queueTimes, int batch, bool early)
+{
+    int clientFd = pop(clientQueue);        // This adds the client to poll (should always succeed)
+    int enqueued = pop(queueTimes);
+    histogramRecord(&table->queueWait, (long long)(unsigned)(monotonicMs() - enqueued) * 1000000LL);
+    int index = addClient(table, clientFd, batch, 0);
+    trace(TRACE_ADMIT, clientFd, batch);
+    table->cold[index].admittedNs = monotonicNs();
+    table->cold[index].early = early;
+    socklen_t addressLength = sizeof(table->cold[index].sockAddr);
+    // Need to get the address before potential DC from the client (to report)
+    errno = 0;
+    if((getpeername(clientFd, (struct sockaddr*) &table->cold[index].sockAddr, &addressLength)) == -1)
+    {
+        perror("getpeername");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void dropClient(struct ClientTable * table, int index, struct StorageShards * shards, struct BatchPool * batchPool)
+{
+    // Write a report, disconnect the client, the last client takes its place
+    releaseBatch(batchPool, shards, table->batch[index]);
+    clientDisconnectReport(table, index);
+    close(table->pollFD[POLL_FIXED + index].fd);
+    removeClient(table, index);
+}
+
+void wakeStarved(struct ClientTable * table, struct BatchPool * batchPool)
+{
+    // Clients sent everything their filling batch had (-e) sit out of the poll until it has more
+    for(int i = 0; i < table->count; i++)
+    {
+        struct pollfd * clientFD = &table->pollFD[POLL_FIXED + i];
+        if(clientFD->events == 0 && batchPool->batches[table->batch[i]].filled > table->alreadySent[i])
+            clientFD->events = POLLOUT | POLLHUP;
     }
 }
 
-void pollTimer(struct pollfd * pollFD, struct buffer * clientQueue, struct Storage * storage, const int * clientDataSize)
+void pollTimer(struct ClientTable * table, struct buffer * clientQueue, struct StorageShards * shards, struct BatchPool * batchPool)
 {
-    if(pollFD[MAX_CLIENTS+1].revents & POLLERR)             // POLLERR for the timerFD
+    struct pollfd * pollFD = table->pollFD;
+    if(pollFD[POLL_TIMER].revents & POLLERR)             // POLLERR for the timerFD
     {
         perror("timerFD pollerr");
         exit(EXIT_FAILURE);
     }
-    if(pollFD[MAX_CLIENTS+1].revents & POLLIN)              // POLLIN for the timerFD (5 sec interval timeout)
+    if(pollFD[POLL_TIMER].revents & POLLIN)                 // POLLIN for the timerFD (5 sec interval timeout)
     {
         uint64_t timesExpired;      // Could use this for some warnings but whatever
-        int readTimerErr = read(pollFD[MAX_CLIENTS+1].fd, &timesExpired, sizeof(timesExpired) );
+        int readTimerErr = read(pollFD[POLL_TIMER].fd, &timesExpired, sizeof(timesExpired) );
         if(readTimerErr == -1)
         {
             perror("read timerfd");
             exit(EXIT_FAILURE);
         }
-        intervalReport(*clientDataSize, getCurrentSize(clientQueue), *storage); // 5 sec interval report
-        storage->prevStorage = storage->currentStorage;                         //
+        intervalReport(table, getCurrentSize(clientQueue), shards, batchPool);  // 5 sec interval report
+        for(int i = 0; i < shards->count; i++)                                 //
+            shards->storage[i].prevStorage = shards->storage[i].currentStorage;
+    }
+}
+
+void pollUpgrade(struct ClientTable * table, struct buffer * clientQueue, struct buffer * queueTimes, struct StorageShards * shards, struct BatchPool * batchPool, struct Server * server)
+{
+    if(table->pollFD[POLL_UPGRADE].revents & POLLIN)      // POLLIN for the upgradeFD (new process wants to take over)
+    {
+        struct HandoffState state = {};
+        int fds[HANDOFF_MAX_FDS];
+        int fdCount = 0;
+        fds[fdCount++] = server->socketFd;
+        fds[fdCount++] = server->statusFd;
+        state.shardCount = shards->count;
+        state.hasControl = shards->controlWrite[0] != -1;
+        for(int i = 0; i < shards->count; i++)
+        {
+            fds[fdCount++] = shards->pipeRead[i];
+            state.storage[i] = shards->storage[i];  // Reserved data goes with the polled clients
+        }
+        for(int i = 0; state.hasControl && i < shards->count; i++)
+            fds[fdCount++] = shards->controlWrite[i];
+        fds[fdCount++] = batchPool->fd;             // Batches are shared memory - the new process maps them
+        state.hasOverflow = shards->overflow != NULL;
+        state.highWater = shards->highWater;
+        if(state.hasOverflow)                       // So is the overflow
+            fds[fdCount++] = shards->overflowFd;
+        state.groupSize = batchPool->groupSize;
+        state.queuedCount = getCurrentSize(clientQueue);
+        for(int i = 0; i < state.queuedCount; i++)
+        {
+            int clientFd = pop(clientQueue);
+            int enqueued = pop(queueTimes);
+            fds[fdCount++] = clientFd;
+            state.queueTimes[i] = enqueued;
+            push(clientQueue, clientFd);            // Keep our queue intact in case the handoff fails
+            push(queueTimes, enqueued);
+        }
+        for(int i = 0; i < table->count; i++)       // In-flight transfers carry on in the new process
+        {
+            fds[fdCount++] = table->pollFD[POLL_FIXED + i].fd;
+            state.clientData[state.polledCount++] = (struct ClientTransferData){.alreadySent = table->alreadySent[i],
+                    .batch = table->batch[i], .sockAddr = table->cold[i].sockAddr, .admittedNs = table->cold[i].admittedNs,
+                    .early = table->cold[i].early};
+        }
+        if(handOver(table->pollFD[POLL_UPGRADE].fd, &state, fds, fdCount))
+        {
+            fprintf(stderr, "Handed over %d queued and %d polled clients. Exiting.\n", state.queuedCount, state.polledCount);
+            exit(EXIT_SUCCESS);
+        }
+    }
+}
+
+void restoreHandoff(struct HandoffState * state, int * fds, struct ClientTable * table, struct buffer * clientQueue, struct buffer * queueTimes, struct StorageShards * shards)
+{
+    for(int i = 0; i < state->shardCount; i++)
+        shards->storage[i] = state->storage[i];
+    // serverFD, statusFD, pipeRead(s), [controlWrite(s)], batch pool, [overflow]
+    int fdIter = 3 + state->shardCount * (1 + state->hasControl) + state->hasOverflow;
+    for(int i = 0; i < state->queuedCount; i++)
+    {
+        push(clientQueue, fds[fdIter++]);
+        push(queueTimes, state->queueTimes[i]);     // CLOCK_MONOTONIC is system wide - waits carry on
+    }
+    for(int i = 0; i < state->polledCount; i++)
+    {
+        struct ClientTransferData * clientData = &state->clientData[i];
+        int index = addClient(table, fds[fdIter++], clientData->batch, clientData->alreadySent);
+        table->cold[index] = (struct ClientCold){.sockAddr = clientData->sockAddr, .admittedNs = clientData->admittedNs,
+                                                 .early = clientData->early};
+    }
+    fprintf(stderr, "Took over %d queued and %d polled clients.\n", state->queuedCount, state->polledCount);
+}
+
+void pollStatus(struct ClientTable * table, struct buffer * clientQueue, struct StorageShards * shards)
+{
+    if(table->pollFD[POLL_STATUS].revents & POLLIN)      // POLLIN for the statusFD (konsument asks how busy we are)
+    {
+        uint32_t request = 0;
+        struct sockaddr_in from;
+        socklen_t fromLength = sizeof(from);
+        errno = 0;
+        int num = recvfrom(table->pollFD[POLL_STATUS].fd, &request, sizeof(request), MSG_DONTWAIT, (struct sockaddr*)&from, &fromLength);
+        if(num == -1)           // Not fatal - the konsument stops waiting and asks another producent
+        {
+            perror("recvfrom status");
+            return;
+        }
+        if(num != sizeof(request) || ntohl(request) != STATUS_MAGIC)
+            return;
+        struct Storage storage;
+        aggregateStorage(shards, &storage);
+        struct StatusReply reply = {.magic = htonl(STATUS_MAGIC), .queued = htonl(getCurrentSize(clientQueue)),
+                                    .polled = htonl(table->count), .currentStorage = htonl(storage.currentStorage),
+                                    .freeData = htonl(storage.freeData)};
+        errno = 0;
+        if(sendto(table->pollFD[POLL_STATUS].fd, &reply, sizeof(reply), MSG_DONTWAIT, (struct sockaddr*)&from, fromLength) == -1)
+            perror("sendto status");
     }
 }
 
-void pollServer(struct pollfd * pollFD, struct buffer * clientQueue, const int * clientDataSize, int * ready, struct Server * server)
+void pollServer(struct ClientTable * table, struct buffer * clientQueue, struct buffer * queueTimes, int * ready, struct Server * server)
 {
-    if(pollFD[MAX_CLIENTS].revents & POLLERR)       // POLLERR for the serverFD
+    struct pollfd * pollFD = table->pollFD;
+    if(pollFD[POLL_SERVER].revents & POLLERR)       // POLLERR for the serverFD
     {
         perror("serverFD pollerr");
         exit(EXIT_FAILURE);
     }
-    if(pollFD[MAX_CLIENTS].revents & POLLIN)        // POLLIN for the serverFD (new connection)
+    if(pollFD[POLL_SERVER].revents & POLLIN)        // POLLIN for the serverFD (new connection)
     {
 
-        if(getCurrentSize(clientQueue) + *clientDataSize < MAX_CLIENTS)      // This checks if we exceed MAX_CLIENTS
+        if(getCurrentSize(clientQueue) + table->count < MAX_CLIENTS)         // This checks if we exceed MAX_CLIENTS
         {                                                                    // (both in queue and currently polled)
             struct sockaddr_in clientAddress;
             uint32_t clientSize = sizeof(clientAddress);
@@ -162,120 +372,108 @@ void pollServer(struct pollfd * pollFD, struct buffer * clientQueue, const int *
                 perror("accept clientFD");
                 exit(EXIT_FAILURE);
             }                                       // Not adding to the poll yet
+            setBusyPoll(clientFd, server->busyPoll);
+            trace(TRACE_ACCEPT, clientFd, 0);
             push(clientQueue, clientFd);            // Accepted client gets pushed onto a circular buffer queue (should always succeed)
+            push(queueTimes, monotonicMs());        // Queue wait starts now
             (*ready)--;
             return;
         }
         else
         {
             // Can't fit more clients
-            pollFD[MAX_CLIENTS].revents = 0;        // Idk if needed
+            pollFD[POLL_SERVER].revents = 0;        // Idk if needed
             return;
         }
     }
 }
 
-void pollClients(int *ready, struct pollfd * pollFD, struct ClientTransferData * clientData, int pipeRead, struct Storage * storage, int * clientDataSize)
+void pollClients(int *ready, struct ClientTable * table, struct StorageShards * shards, struct BatchPool * batchPool)
 {
-    int iterator = 0;
-    while( (*ready) && iterator < MAX_CLIENTS)       // Iterate over all the polled descriptors
-    {                                                // Theoretically (ready && iterator < clientDataSize should suffice)
-        if(pollFD[iterator].revents & POLLHUP)
-        {
-            // -- Client disconnected. Need to flush down the wasted data and update all the structures.
-            (*ready)--;
-
-            if(clientData[iterator].alreadySent != 0) // Transmission has begun, dump the rest of the data
-            {
-                int wastedData = 0;
-                char buf[SEND_THRESHOLD];                           // Could read into /dev/null instead of buf
-                errno = 0;
-                if((wastedData = read(pipeRead,  buf, SEND_THRESHOLD - clientData[iterator].alreadySent)) == -1)
-                {
-                    perror("read waste from pipe");
-                    exit(EXIT_FAILURE);
-                }
-                storage->reservedData -= wastedData;
-            }
-            else        // No transmission - can recover the data
-            {
-                storage->reservedData -= SEND_THRESHOLD;
-                storage->freeData += SEND_THRESHOLD;
-                clientData[iterator].alreadySent = SEND_THRESHOLD;       // So the report lines up (0 bytes wasted)
-            }
-            clientDisconnectReport(clientData[iterator]);       // Prints the report
-            clientData[iterator].alreadySent = 0;               // Reuse clientData structure
-            (*clientDataSize)--;                                //
-
-            pollFD[iterator].fd = -1;                           // Reuse pollFD structure
-            close(pollFD[iterator].fd);                         //
-        }
-        if(pollFD[iterator].revents & POLLOUT)                  // Sending client the data
+    // Only the polled clients, backwards - a dropped client is replaced by the last one, which is already handled
+    for(int i = table->count - 1; i >= 0 && *ready > 0; i--)
+    {
+        struct pollfd * clientFD = &table->pollFD[POLL_FIXED + i];
+        if(!(clientFD->revents & (POLLHUP | POLLOUT)))
+            continue;
+        (*ready)--;
+        struct Batch * batch = &batchPool->batches[table->batch[i]];
+        if(!(clientFD->revents & POLLHUP))
         {
             errno = 0;
-            int testForDc = recv(pollFD[iterator].fd, NULL, 1, MSG_PEEK|MSG_DONTWAIT);
+            int testForDc = recv(clientFD->fd, NULL, 1, MSG_PEEK|MSG_DONTWAIT);
             if(testForDc == 0)      // Test if client has already DC'd
-            {
-                pollFD[iterator].revents = POLLHUP;     // If DC - send him straight to POLLHUP
-                continue;
-            }
-
-            if(clientData[iterator].alreadySent == SEND_THRESHOLD)       // If the transaction has completed
-            {
-                // Write a report. Disconnect the client. Reuse structures.
-                clientDisconnectReport(clientData[iterator]);
-                close(pollFD[iterator].fd);
-                pollFD[iterator].fd = -1;
-                clientData[iterator].alreadySent = 0;
-                (*clientDataSize)--;
-                break;
-            }
-
-            // --- Transmission ---
-
-            // Determines the size of the package (PACKAGE_SIZE or whatever is left that is < than PACKAGE_SIZE)
-            int readSize = ( SEND_THRESHOLD - clientData[iterator].alreadySent > PACKAGE_SIZE ?
-                             PACKAGE_SIZE : SEND_THRESHOLD - clientData[iterator].alreadySent );
+                clientFD->revents = POLLHUP;    // If DC - send him straight to POLLHUP
+        }
+        if(clientFD->revents & POLLHUP)
+        {
+            // -- Client disconnected. Need to release the batch and update all the structures.
+            if(!batch->sent)            // No transmission - the batch goes back to the ready ones
+                table->alreadySent[i] = SEND_THRESHOLD;     // So the report lines up (0 bytes wasted)
+            else if(batch->filling)     // Only what's been read of it is lost, the rest is still in the pipe
+                table->alreadySent[i] += SEND_THRESHOLD - batch->filled;
+            trace(TRACE_DISCONNECT, clientFD->fd, SEND_THRESHOLD - table->alreadySent[i]);
+            dropClient(table, i, shards, batchPool);        // A reset comes with POLLOUT too - nothing to send to
+            continue;
+        }
+        if(table->alreadySent[i] == SEND_THRESHOLD)         // If the transaction has completed
+        {
+            trace(TRACE_COMPLETE, clientFD->fd, 0);
+            if(!table->cold[i].early)                       // Transfer time of a whole batch - the forecast horizon
+                recordTransfer(batchPool, monotonicNs() - table->cold[i].admittedNs);
+            dropClient(table, i, shards, batchPool);
+            continue;
+        }
+        if(table->alreadySent[i] == batch->filled)          // Caught up with a filling batch - the forecast was missed
+        {
+            clientFD->events = 0;                           // Out of the poll until the pipe gives it more (wakeStarved)
+            continue;
+        }
 
-            int num = 0;
-            errno = 0;
-            char package[PACKAGE_SIZE]={};                          // Read the package from pipe
-            if((num = read(pipeRead, package, readSize)) == -1)
-            {
-                perror("read from pipe");
-                exit(EXIT_FAILURE);
-            }
-            if((num = write(pollFD[iterator].fd, package, readSize)) == -1)     // Write it to the client
-            {
-                perror("write to client");
-                exit(EXIT_FAILURE);
-            }
-            // Not checking if num == readSize (shouldn't be an error)
-            clientData[iterator].alreadySent += num;                // Update total num of bytes send
-            storage->reservedData -= num;                           // Update total amt. of reserved data
-            (*ready)--;
-            updateStorage(storage, pipeRead);                       // Reassess the storage (mb not necessary)
+        // --- Transmission --- the rest of the batch (what's been read of it), as much of it as the socket takes
+        errno = 0;
+        int num = send(clientFD->fd, batchData(batchPool, table->batch[i]) + table->alreadySent[i],
+                       batch->filled - table->alreadySent[i], MSG_DONTWAIT);
+        if(num == -1 && errno != EAGAIN)
+        {
+            perror("send to client");
+            exit(EXIT_FAILURE);
+        }
+        if(num > 0)
+        {
+            trace(TRACE_SEND, clientFD->fd, num);
+            if(table->alreadySent[i] == 0)
+                histogramRecord(&table->firstByte, monotonicNs() - table->cold[i].admittedNs);
+            table->alreadySent[i] += num;           // Update total num of bytes send
+            batch->sent = true;
         }
-        iterator++;
     }
 }
 
-void pollTheFDs(struct pollfd * pollFD, struct buffer * clientQueue, struct ClientTransferData * clientData, struct Storage * storage, int * clientDataSize, struct Server * server, int pipeRead)
+void pollTheFDs(struct ClientTable * table, struct buffer * clientQueue, struct buffer * queueTimes, struct StorageShards * shards, struct BatchPool * batchPool, struct Server * server, int pollWait)
 {
+    // pollWait 0 (-s) - the loop never sleeps, the main loop spins through the storage checks instead
     int ready = 0;
-    while((ready = poll(pollFD, MAX_CLIENTS+2, POLL_WAIT)) != -1)   // not sure what's the best POLL_WAIT value
+    while((ready = poll(table->pollFD, POLL_FIXED + table->count, pollWait)) != -1)   // not sure what's the best POLL_WAIT value
     {
         if(ready == 0)      // If timeout:
             break;          // Break so we can continually check if storage current size >= 13KiB
         errno = 0;
-        pollTimer(pollFD, clientQueue, storage, clientDataSize);
-        pollServer(pollFD, clientQueue, clientDataSize, &ready, server);
-        pollClients(&ready, pollFD, clientData, pipeRead, storage, clientDataSize);
+        pollTimer(table, clientQueue, shards, batchPool);
+        pollUpgrade(table, clientQueue, queueTimes, shards, batchPool, server);
+        pollStatus(table, clientQueue, shards);
+        pollServer(table, clientQueue, queueTimes, &ready, server);
+        pollClients(&ready, table, shards, batchPool);
+        if(pollWait < POLL_WAIT)    // Spinning or a batch is filling - back to the main loop after every round
+            break;
     }
 }
 
-void intervalReport(int cntPolled, int cntQueued, struct Storage storage)
+void intervalReport(struct ClientTable * table, int cntQueued, struct StorageShards * shards, struct BatchPool * batchPool)
 {
+    int cntPolled = table->count;
+    struct Storage storage;
+    aggregateStorage(shards, &storage);
     struct timespec reportTime;
     clock_gettime(CLOCK_REALTIME, &reportTime);
     char * p = ctime(&reportTime.tv_sec);
@@ -284,25 +482,47 @@ void intervalReport(int cntPolled, int cntQueued, struct Storage storage)
     fprintf(stderr,"%s", p);
     fprintf(stderr, "Clients - total: %d, polled: %d, queued: %d\n", cntPolled+cntQueued, cntPolled, cntQueued);
     fprintf(stderr, "Flow: %d\n", storage.currentStorage - storage.prevStorage);
-    fprintf(stderr, "Storage status : %d, %2.2f %%\n", storage.currentStorage, storage.percentage* 100);
+    fprintf(stderr, "Storage status : %d, %2.2f %%\n", storage.currentStorage - storage.overflowData, storage.percentage* 100);
+    if(shards->overflow != NULL)
+        fprintf(stderr, "Overflow status : %d, %2.2f %% (high-water mark: %d %%)\n", storage.overflowData,
+                (float)storage.overflowData / (float)overflowCapacity(shards) * 100, shards->highWater);
+    for(int i = 0; shards->count > 1 && i < shards->count; i++)
+        fprintf(stderr, "Shard %d : %d, %2.2f %%, ready batches: %d, overflow: %d\n", i,
+                shards->storage[i].currentStorage - shards->storage[i].overflowData, primaryPercentage(&shards->storage[i]) * 100,
+                shards->storage[i].cachedData / SEND_THRESHOLD, shards->storage[i].overflowData);
+    fprintf(stderr, "Batches - ready: %d, being sent: %d\n", storage.cachedData / SEND_THRESHOLD, batchesInUse(batchPool));
+    if(batchPool->early)
+    {
+        float inflowRate = 0;
+        for(int i = 0; i < shards->count; i++)
+            inflowRate += shards->storage[i].inflowRate;
+        fprintf(stderr, "Forecast - production: %.1f (bytes/ms), transfer time: %.3lf (ms)\n", inflowRate, batchPool->transferNs / 1e6);
+    }
+    histogramPrintText(stderr, &table->queueWait);          // Accepted - admitted (ms resolution)
+    histogramPrintText(stderr, &table->firstByte);          // Admitted - first byte sent
+    histogramInit(&table->queueWait, "queueWait");          // Every report covers its own interval
+    histogramInit(&table->firstByte, "firstByte");
     fprintf(stderr, "-------------------------\n");
 }
 
-void clientDisconnectReport(struct ClientTransferData clientData)
+void clientDisconnectReport(struct ClientTable * table, int index)
 {
+    struct ClientCold * clientCold = &table->cold[index];
     struct timespec reportTime;
     clock_gettime(CLOCK_REALTIME, &reportTime);
     char * p = ctime(&reportTime.tv_sec);
     fprintf(stderr, "\n-----DISCONNECT REPORT-----\n");
     fprintf(stderr,"%s", p);
-    fprintf(stderr, "Client address: %s:%hu\n", inet_ntoa(clientData.sockAddr.sin_addr), ntohs(clientData.sockAddr.sin_port));
-    fprintf(stderr, "Wasted data: %d (bytes)\n", SEND_THRESHOLD-clientData.alreadySent);
+    fprintf(stderr, "Client address: %s:%hu\n", inet_ntoa(clientCold->sockAddr.sin_addr), ntohs(clientCold->sockAddr.sin_port));
+    fprintf(stderr, "Transfer time: %.3lf (ms)\n", (monotonicNs() - clientCold->admittedNs) / 1e6);
+    fprintf(stderr, "Wasted data: %d (bytes)\n", SEND_THRESHOLD-table->alreadySent[index]);
     fprintf(stderr, "---------------------------\n");
 }
 
 void updateStorage(struct Storage * storage, int pipeRead)
 {
-    int ioctlErr = ioctl(pipeRead, FIONREAD, &storage->currentStorage);
+    int currentStorage = 0;
+    int ioctlErr = ioctl(pipeRead, FIONREAD, &currentStorage);
     if(ioctlErr == -1)
     {
         perror("ioctl FIONREAD");
@@ -314,15 +534,23 @@ void updateStorage(struct Storage * storage, int pipeRead)
         perror("F_GETPIPE_SZ");
         exit(EXIT_FAILURE);
     }
-    storage->freeData = storage->currentStorage - storage->reservedData;
-    storage->percentage =(float)storage->currentStorage/(float)pipeSize;
+    computeStorage(storage, currentStorage, pipeSize + READY_BATCHES * SEND_THRESHOLD);    // Ready batches are storage too
+    sampleInflow(storage, currentStorage, monotonicMs());
+}
+
+void updateShards(struct StorageShards * shards)
+{
+    for(int i = 0; i < shards->count; i++)
+        updateStorage(&shards->storage[i], shards->pipeRead[i]);
 }
 
-void setupPollFD(struct pollfd * pollFD, struct Server server)
+void setupPollFD(struct pollfd * pollFD, struct Server server, int upgradeFd)
 {
-    //  pollFD[0] - pollFD[MAX_CLIENTS -1] == client indexes
-    //  pollFD[MAX_CLIENTS]                == server index
-    //  pollFD[MAX_CLIENTS+1]              == timerFD index
+    //  pollFD[POLL_SERVER]                == server index
+    //  pollFD[POLL_TIMER]                 == timerFD index
+    //  pollFD[POLL_UPGRADE]               == upgradeFD index (-1 without -u)
+    //  pollFD[POLL_STATUS]                == statusFD index
+    //  pollFD[POLL_FIXED] - ...           == polled clients, set up as they're admitted (clienttable.c)
 
     int timerFd = timerfd_create(CLOCK_REALTIME, 0);
     struct timespec timerInterval = {.tv_sec = 5, .tv_nsec = 0};
@@ -334,37 +562,54 @@ void setupPollFD(struct pollfd * pollFD, struct Server server)
         exit(EXIT_FAILURE);
     }
 
-    pollFD[MAX_CLIENTS].fd = server.socketFd;   // Server poll
-    pollFD[MAX_CLIENTS].events |= POLLIN;
-    pollFD[MAX_CLIENTS].events |= POLLERR;
+    pollFD[POLL_SERVER].fd = server.socketFd;   // Server poll
+    pollFD[POLL_SERVER].events |= POLLIN;
+    pollFD[POLL_SERVER].events |= POLLERR;
 
-    pollFD[MAX_CLIENTS+1].fd = timerFd;         // TimerFD poll
-    pollFD[MAX_CLIENTS+1].events |= POLLIN;
-    pollFD[MAX_CLIENTS+1].events |= POLLERR;
+    pollFD[POLL_TIMER].fd = timerFd;         // TimerFD poll
+    pollFD[POLL_TIMER].events |= POLLIN;
+    pollFD[POLL_TIMER].events |= POLLERR;
+
+    pollFD[POLL_UPGRADE].fd = upgradeFd;       // UpgradeFD poll
+    pollFD[POLL_UPGRADE].events |= POLLIN;
+
+    pollFD[POLL_STATUS].fd = server.statusFd; // StatusFD poll
+    pollFD[POLL_STATUS].events |= POLLIN;
 
-    for(int i=0; i<MAX_CLIENTS; i++)
-    {
-        pollFD[i].fd = -1;                      // ClientFDs poll
-        pollFD[i].events |= POLLOUT;
-        pollFD[i].events |= POLLHUP;
-    }
 }
 
-int setupStorage(float productionRate)
+void setupStorage(struct InputArguments * inputArguments, struct StorageShards * shards)
 {
-    int pipeFD[2]={};
-    errno = 0;
-    int pipeErr = pipe(pipeFD);     // Pipe for communication  between the server and the worker
-    if(pipeErr == -1)
+    // One worker and one storage pipe per shard
+    for(shards->count = 0; shards->count < inputArguments->workerCount; shards->count++)
     {
-        perror("pipe");
-        exit(EXIT_FAILURE);
+        int pipeFD[2]={};
+        int controlFD[2]={-1, -1};
+        errno = 0;
+        int pipeErr = pipe(pipeFD);     // Pipe for communication  between the server and the worker
+        if(pipeErr == -1)
+        {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        if(inputArguments->adaptive)    // Feedback pipe the other way around (server -> worker)
+        {
+            errno = 0;
+            if(pipe2(controlFD, O_NONBLOCK) == -1)  // Neither side ever waits on it
+            {
+                perror("pipe feedback");
+                exit(EXIT_FAILURE);
+            }
+        }
+        trainPeon(pipeFD, controlFD, inputArguments, shards);   // Creates the child process
+        shards->pipeRead[shards->count] = pipeFD[0];
+        shards->controlWrite[shards->count] = controlFD[1];
+        shards->storage[shards->count].inflowRate = inputArguments->productionRate * BASE_RATE / 1000;  // Until it's measured
+        shards->storage[shards->count].lastSample = monotonicMs();
     }
-    trainPeon(pipeFD, productionRate);      // Creates the child process
-    return pipeFD[0];                       // Returns the file descriptor
 }
 
-void trainPeon(int * pipeFD, float productionRate)
+void trainPeon(int * pipeFD, int * controlFD, struct InputArguments * inputArguments, struct StorageShards * shards)
 {
     pid_t currPID = fork();
     if( currPID == -1 )                   // -- Errors
@@ -375,21 +620,45 @@ void trainPeon(int * pipeFD, float productionRate)
     else if ( currPID == 0 )             // -- Child
     {
         close(pipeFD[0]);            // -- Close read
-        workWork(productionRate, pipeFD[1]);
+        if(controlFD[1] != -1)
+            close(controlFD[1]);     // -- Close feedback write
+        for(int i = 0; i < shards->count; i++)     // -- Close the server ends of the workers forked before us
+        {
+            close(shards->pipeRead[i]);
+            if(shards->controlWrite[i] != -1)
+                close(shards->controlWrite[i]);
+        }
+        if(inputArguments->workerCpu != -1)
+            pinToCpu(inputArguments->workerCpu + shards->count);
+        traceFork("worker");
+        workWork(inputArguments, shards->count, pipeFD[1], controlFD[0]);   // shards->count - our shard index
         exit(EXIT_SUCCESS);
     }
     else                                // -- Parent
     {
         close(pipeFD[1]);           // -- Close write
+        if(controlFD[0] != -1)
+            close(controlFD[0]);    // -- Close feedback read
     }
 }
 
-void workWork(float productionRate, int pipeWrite)
+void workWork(struct InputArguments * inputArguments, int shard, int pipeWrite, int controlRead)
 {
     // The peon, in his eternal struggle, works to produce data
 
+    struct RateController controller;           // Only used with a feedback pipe (-a)
+    controllerInit(&controller, inputArguments->productionRate, inputArguments->minRate,
+                   inputArguments->maxRate, inputArguments->waitTarget);
+    struct timespec lastFeedback;
+    clock_gettime(CLOCK_MONOTONIC, &lastFeedback);
+
     struct timespec sleepTime={};
-    parseTime(productionRate, &sleepTime);
+    parseTime(controlRead == -1 ? inputArguments->productionRate : controller.rate, &sleepTime);
+    if(controlRead != -1 && fcntl(pipeWrite, F_SETFL, O_NONBLOCK) == -1)
+    {
+        perror("fcntl O_NONBLOCK");
+        exit(EXIT_FAILURE);
+    }
     errno = 0;
     int pipeSize = fcntl(pipeWrite, F_GETPIPE_SZ);
     if(pipeSize == -1)
@@ -401,36 +670,200 @@ void workWork(float productionRate, int pipeWrite)
     char value = 65;
     while(1)
     {
-        nanosleep(&sleepTime, NULL);    // No signal to interrupt.
-        memset(theBlock, value, BLOCK_SIZE);
-        value++;
-        if(value == 91)
-            value = 97;
-        if(value == 123)
-            value = 65;
+        if(traceStopped())
+            exit(EXIT_SUCCESS);
+        if(controlRead == -1)
+            nanosleep(&sleepTime, NULL);    // Only interrupted by the -T stop signals
+        else
+            adaptiveSleep(&controller, controlRead, &sleepTime, &lastFeedback);
+        value = nextBlock(theBlock, value);
         errno = 0;
-        if(write(pipeWrite, theBlock, BLOCK_SIZE) == -1)
+        while(write(pipeWrite, theBlock, BLOCK_SIZE) == -1)
         {
-            if(errno == EPIPE)
+            if(errno == EAGAIN)         // Adaptive worker - storage full, keep listening to the server meanwhile
+            {
+                waitForPipe(&controller, controlRead, pipeWrite, &sleepTime, &lastFeedback);
+                errno = 0;
+            }
+            else if(errno == EPIPE)
             {
                 perror("epipe");
                 exit(EXIT_FAILURE);
             }
+            else if(errno == EINTR)     // Stop signal with -T - the block is dropped
+            {
+                exit(EXIT_SUCCESS);
+            }
             else
             {
                 perror("write");
                 exit(EXIT_FAILURE);
             }
         }
+        trace(TRACE_PRODUCE, shard, BLOCK_SIZE);
+    }
+}
+
+char nextBlock(char * block, char value)
+{
+    // The block is one letter repeated, the next block gets the next letter (A-Z, a-z, then A again)
+    memset(block, value, BLOCK_SIZE);
+    value++;
+    if(value == 91)
+        value = 97;
+    if(value == 123)
+        value = 65;
+    return value;
+}
+
+void adaptiveSleep(struct RateController * controller, int controlRead, struct timespec * sleepTime, struct timespec * lastFeedback)
+{
+    // Sleeps sleepTime like nanosleep, but wakes up for feedback from the server and re-paces the rest of the sleep
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct pollfd controlPoll = {.fd = controlRead, .events = POLLIN};
+    while(1)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long slept = (now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec);
+        long long remaining = sleepTime->tv_sec * 1000000000LL + sleepTime->tv_nsec - slept;
+        if(remaining <= 0)
+            return;
+        struct timespec timeout = {.tv_sec = remaining / 1000000000LL, .tv_nsec = remaining % 1000000000LL};
+        errno = 0;
+        int ready = ppoll(&controlPoll, 1, &timeout, NULL);
+        if(ready == 0)
+            return;
+        if(ready == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("ppoll feedback");
+            exit(EXIT_FAILURE);
+        }
+        readFeedback(controller, controlRead, sleepTime, lastFeedback);
+    }
+}
+
+void waitForPipe(struct RateController * controller, int controlRead, int pipeWrite, struct timespec * sleepTime, struct timespec * lastFeedback)
+{
+    // Blocks until there's room in the storage pipe, handling feedback in the meantime
+    struct pollfd workerPoll[2] = {{.fd = pipeWrite, .events = POLLOUT}, {.fd = controlRead, .events = POLLIN}};
+    errno = 0;
+    if(poll(workerPoll, 2, -1) == -1)
+    {
+        if(errno == EINTR)
+            return;
+        perror("poll storage pipe");
+        exit(EXIT_FAILURE);
+    }
+    if(workerPoll[1].revents)
+        readFeedback(controller, controlRead, sleepTime, lastFeedback);
+}
+
+void readFeedback(struct RateController * controller, int controlRead, struct timespec * sleepTime, struct timespec * lastFeedback)
+{
+    struct WorkerFeedback feedback, latest;     // Only the newest message matters
+    int received = 0;
+    int readNum;
+    while((readNum = read(controlRead, &feedback, sizeof(feedback))) == sizeof(feedback))
+    {
+        latest = feedback;
+        received++;
+    }
+    if(readNum == 0)                            // EOF - nobody holds the write end anymore
+    {
+        fprintf(stderr, "Server closed the feedback pipe.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(received == 0)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - lastFeedback->tv_sec) + (now.tv_nsec - lastFeedback->tv_nsec) / 1e9;
+    *lastFeedback = now;
+    float prevRate = controller->rate;
+    parseTime(controllerUpdate(controller, &latest, elapsed), sleepTime);
+    if(controller->rate != prevRate && (controller->rate == controller->minRate || controller->rate == controller->maxRate))
+        fprintf(stderr, "Worker production rate at its %s bound: %.2f\n",
+                controller->rate == controller->minRate ? "min" : "max", controller->rate);
+}
+
+void sendFeedback(struct buffer * clientQueue, struct buffer * queueTimes, struct StorageShards * shards, int * lastFeedback)
+{
+    if(shards->controlWrite[0] == -1)
+        return;
+    int now = monotonicMs();
+    if((unsigned)now - (unsigned)*lastFeedback < FEEDBACK_INTERVAL)
+        return;
+    *lastFeedback = now;
+    // The queue is shared by all the workers, storage fill is their own
+    struct WorkerFeedback feedback = {.queueDepth = getCurrentSize(clientQueue), .oldestWait = 0};
+    if(getCurrentSize(queueTimes) != 0)
+        feedback.oldestWait = (int)((unsigned)now - (unsigned)peek(queueTimes));
+    for(int i = 0; i < shards->count; i++)
+    {
+        feedback.percentage = shards->storage[i].percentage;
+        errno = 0;
+        if(write(shards->controlWrite[i], &feedback, sizeof(feedback)) == -1 && errno != EAGAIN)   // Worker busy - it gets the next one
+        {
+            perror("write feedback");
+            exit(EXIT_FAILURE);
+        }
     }
 }
 
-void parseTime(float productionRate, struct timespec * sleepTime)
+long long monotonicNs(void)
 {
-    // First translate to nano seconds so we don't lose data from float precision and simple division
-    size_t nanoTime = BLOCK_SIZE / (productionRate * BASE_RATE) * 1000000000;
-    sleepTime->tv_sec = nanoTime / 1000000000;
-    sleepTime->tv_nsec = nanoTime % (size_t)(1000000000);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void pinToCpu(int cpu)
+{
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    errno = 0;
+    if(sched_setaffinity(0, sizeof(cpuSet), &cpuSet) == -1)
+    {
+        fprintf(stderr, "CPU %d: ", cpu);
+        perror("sched_setaffinity");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void setBusyPoll(int fd, int busyPoll)
+{
+    // Not fatal - raising SO_BUSY_POLL above net.core.busy_poll needs CAP_NET_ADMIN, the client is served either way
+    static bool warned = false;
+    if(busyPoll == 0)
+        return;
+    errno = 0;
+    if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll)) == -1 && !warned)
+    {
+        perror("setsockopt SO_BUSY_POLL");
+        warned = true;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    errno = 0;
+    if(setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1 && !warned)
+    {
+        perror("setsockopt SO_PREFER_BUSY_POLL");
+        warned = true;
+    }
+#endif
+}
+
+int monotonicMs(void)
+{
+    // Wraps around every ~49 days - only compare two of these through unsigned subtraction
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int)(unsigned)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
 }
 
 void parseInputArguments(int argc, char** argv, struct InputArguments * inputArguments)
@@ -438,42 +871,174 @@ void parseInputArguments(int argc, char** argv, struct InputArguments * inputArg
     bool pFlag = false;
     checkArgCount(argc,argv);
     int opt;
-    while ((opt = getopt(argc, argv, ":p:")) != -1) {
+    inputArguments->upgradePath[0] = '\0';
+    inputArguments->adaptive = false;
+    inputArguments->waitTarget = 1000;
+    inputArguments->workerCount = 1;
+    inputArguments->groupSize = 1;
+    inputArguments->serverCpu = inputArguments->workerCpu = -1;
+    inputArguments->spin = false;
+    inputArguments->early = false;
+    inputArguments->overflowPath = NULL;
+    inputArguments->highWater = HIGH_WATER;
+    inputArguments->tracePrefix = NULL;
+    while ((opt = getopt(argc, argv, ":p:u:a:l:w:b:P:seT:o:H:")) != -1) {
         switch (opt) {
             case 'p':
                 inputArguments->productionRate = (float)getFloat(optarg);
                 pFlag = true;
                 break;
+            case 'u':
+                if(strlen(optarg) >= sizeof(inputArguments->upgradePath))
+                {
+                    fprintf(stderr, "Upgrade socket path too long\n");
+                    exit(EXIT_FAILURE);
+                }
+                strcpy(inputArguments->upgradePath, optarg);
+                break;
+            case 'a':
+                parseRateBounds(optarg, inputArguments);
+                inputArguments->adaptive = true;
+                break;
+            case 'w':
+                inputArguments->workerCount = getInt(optarg);
+                if(inputArguments->workerCount < 1 || inputArguments->workerCount > MAX_SHARDS)
+                {
+                    fprintf(stderr, "Worker count has to be between 1 and %d\n", MAX_SHARDS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                inputArguments->groupSize = getInt(optarg);
+                if(inputArguments->groupSize < 1 || inputArguments->groupSize > MAX_CLIENTS)
+                {
+                    fprintf(stderr, "Broadcast group size has to be between 1 and %d\n", MAX_CLIENTS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                parseCpus(optarg, inputArguments);
+                break;
+            case 's':
+                inputArguments->spin = true;
+                break;
+            case 'e':
+                inputArguments->early = true;
+                break;
+            case 'o':
+                inputArguments->overflowPath = optarg;
+                break;
+            case 'H':
+                inputArguments->highWater = getInt(optarg);
+                if(inputArguments->highWater < 1 || inputArguments->highWater > 100)
+                {
+                    fprintf(stderr, "High-water mark has to be between 1 and 100 (%%)\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                inputArguments->tracePrefix = optarg;
+                break;
+            case 'l':
+                inputArguments->waitTarget = getInt(optarg);
+                if(inputArguments->waitTarget == 0)
+                {
+                    fprintf(stderr, "Queue wait SLO has to be positive\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case ':': // Missing argument
                 fprintf(stderr, "Missing argument!\n");
-                fprintf(stderr, "USAGE: -p <float> [<addr>:]port \n");
+                fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port \n");
                 exit(EXIT_FAILURE);
             case '?': // Unrecognized option
                 fprintf(stderr, "Unrecognized option: %c%c, arg: %d\n",
                         argv[optind - 1][0],argv[optind - 1][1], optind-1);
-                fprintf(stderr, "USAGE: -p <float> [<addr>:]port\n");
+                fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
                 exit(EXIT_FAILURE);
             default: // Unrecognized case in switch
                 fprintf(stderr, "Unrecognized case\n");
-                fprintf(stderr, "USAGE: -p <float> [<addr>:]port\n");
+                fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
                 exit(EXIT_FAILURE);
         }
     }
     if(!pFlag)
     {
         fprintf(stderr, "Did not find required flags!\n");
-        fprintf(stderr, "USAGE: -p <float> [<addr>:]port \n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port \n");
         exit(EXIT_FAILURE);
     }
+    checkCpus(inputArguments);
     parseInputAddr(argv, inputArguments);
 }
 
+void parseRateBounds(char * arg, struct InputArguments * inputArguments)
+{
+    // <min>:<max> - bounds for the adaptive production rate
+    char *token = strtok(arg, ":");
+    char *maxToken = strtok(NULL, "");
+    if(token == NULL || maxToken == NULL)
+    {
+        fprintf(stderr, "Bad rate bounds, expected <min>:<max>\n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
+        exit(EXIT_FAILURE);
+    }
+    inputArguments->minRate = (float)getFloat(token);
+    inputArguments->maxRate = (float)getFloat(maxToken);
+    if(inputArguments->minRate <= 0 || inputArguments->minRate > inputArguments->maxRate)
+    {
+        fprintf(stderr, "Rate bounds have to satisfy 0 < min <= max\n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parseCpus(char * arg, struct InputArguments * inputArguments)
+{
+    // <server>:<worker> - CPUs for the low-latency mode
+    char *token = strtok(arg, ":");
+    char *workerToken = strtok(NULL, "");
+    if(token == NULL || workerToken == NULL)
+    {
+        fprintf(stderr, "Bad CPUs, expected <server>:<worker>\n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
+        exit(EXIT_FAILURE);
+    }
+    inputArguments->serverCpu = getInt(token);
+    inputArguments->workerCpu = getInt(workerToken);
+}
+
+void checkCpus(struct InputArguments * inputArguments)
+{
+    // Checked up front - a worker that can't be pinned would only die after the fork
+    if(inputArguments->serverCpu == -1)
+        return;
+    cpu_set_t allowed;
+    errno = 0;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        perror("sched_getaffinity");
+        exit(EXIT_FAILURE);
+    }
+    int lastCpu = inputArguments->workerCpu + inputArguments->workerCount - 1;
+    for(int cpu = inputArguments->workerCpu; cpu <= lastCpu + 1; cpu++)
+    {
+        int wanted = cpu > lastCpu ? inputArguments->serverCpu : cpu;      // Workers, then the server
+        if(wanted >= CPU_SETSIZE || !CPU_ISSET(wanted, &allowed))
+        {
+            fprintf(stderr, "CPU %d isn't available (server: %d, workers: %d - %d)\n", wanted,
+                    inputArguments->serverCpu, inputArguments->workerCpu, lastCpu);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
 void parseInputAddr(char ** argv, struct InputArguments * inputArguments)
 {
     // Input addr is verified later by inet_aton (eg. if address is theoretically invalid, but goes through inet_aton - all is good
     if(argv[optind] == NULL)
     {
-        fprintf(stderr, "USAGE: -p <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
         exit(EXIT_FAILURE);
     }
     if(strchr(argv[optind], ':') == NULL)
@@ -528,11 +1093,24 @@ void setupServer(struct Server * server, struct InputArguments * inputArguments)
     }
 
     errno = 0;
-    if((listen(server->socketFd, 5)) == -1)
+    if((listen(server->socketFd, LISTEN_BACKLOG)) == -1)
     {
         perror("listen server socket");
         exit(EXIT_FAILURE);
     }
+
+    errno = 0;
+    if((server->statusFd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+    {
+        perror("creating status socket");
+        exit(EXIT_FAILURE);
+    }
+    errno = 0;
+    if((bind(server->statusFd, (struct sockaddr*) &server->sockAddr, sizeof(server->sockAddr))) == -1)
+    {
+        perror("bind status socket");
+        exit(EXIT_FAILURE);
+    }
 }
 
 double getFloat(char * arg)
@@ -546,13 +1124,13 @@ double getFloat(char * arg)
     if (*endptr != '\0')
     {
         fprintf(stderr,"Non-numeric argument: %s, at %s, arg: %d\n", arg, endptr, optind-1);
-        fprintf(stderr, "USAGE: -p <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
         exit(EXIT_FAILURE);
     }
     if (res < 0)
     {
         fprintf(stderr,"Negative values not allowed\n");
-        fprintf(stderr, "USAGE: -p <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
         exit(EXIT_FAILURE);
     }
     return res;
@@ -569,13 +1147,13 @@ int getInt(char * arg)
     if (*endptr != '\0')
     {
         fprintf(stderr,"Non-numeric argument: %s, at %s, arg: %d\n", arg, endptr, optind-1);
-        fprintf(stderr, "USAGE: -p <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
         exit(EXIT_FAILURE);
     }
     if (res < 0)
     {
         fprintf(stderr,"Negative values not allowed\n");
-        fprintf(stderr, "USAGE: -p <float> [<addr>:]port\n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port\n");
         exit(EXIT_FAILURE);
     }
     return res;
@@ -583,9 +1161,9 @@ int getInt(char * arg)
 
 void checkArgCount(int argc, char ** argv)
 {
-    if( (argc > 4 || argc < 3) || strcmp(argv[1], "--help") == 0)
+    if( (argc > 24 || argc < 3) || strcmp(argv[1], "--help") == 0)
     {
-        fprintf(stderr, "USAGE: -p <float> [<addr>:]port \n");
+        fprintf(stderr, "USAGE: -p <float> [-w <int>] [-b <int>] [-a <min>:<max>] [-l <ms>] [-P <cpu>:<cpu>] [-s] [-e] [-o <path>] [-H <int>] [-T <prefix>] [-u <path>] [<addr>:]port \n");
         exit(EXIT_FAILURE);
     }
 }
@@ -0,0 +1,964 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "storage.h"
+#include "batch.h"
+#include "overflow.h"
+#include "../decay.h"
+#include "../clientstorage.h"
+
+// Deterministic virtual-time simulation of producent + N konsuments.
+// The server side runs the server's batch pool (batch.c) without the data: every shard's pipe (-w) is read into
+// ready batches, a queued client (a group of them with -b) is bound to the oldest one, -e binds a batch that's still
+// filling and -o spills the pipe above the high-water mark into an overflow tier that's served first.
+// The pool and all the storage accounting (storage.c) are the same code the server uses.
+// Every client is a konsument: up to -j batch connections while its projected capacity has room, every read paced
+// by -r and added to its own block storage (clientstorage.c) with the -m decay policy. Nothing sleeps - the clock is virtual.
+
+#define PIPE_SIZE 65536         // Default F_GETPIPE_SZ
+#define SEND_STEP 1000          // Virtual ns between two consecutive sends to the same client (one poll round)
+#define REPORT_INTERVAL 5000000000L
+#define NSEC 1000000000L
+#define SYN_TIMEOUT 1000000000L // First SYN retransmission, doubled every time (Linux TCP_TIMEOUT_INIT)
+#define SYN_RETRIES 6           // Default net.ipv4.tcp_syn_retries - then connect() fails with ETIMEDOUT
+
+enum EventType
+{
+    EV_PRODUCE,         // Worker wakes up from nanosleep and writes a block
+    EV_ARRIVE,          // Konsument starts, opens its connections (they land in the listen backlog)
+    EV_SYN_RETRY,       // Connection's SYN was dropped (backlog full), retransmitted
+    EV_SEND,            // Server gets POLLOUT for an admitted connection
+    EV_READ,            // Konsument's next read of a connection is due
+    EV_REPORT           // 5 sec interval report
+};
+
+struct Event
+{
+    int64_t time;
+    uint64_t seq;       // Tie breaker - keeps the simulation deterministic
+    int type;
+    int id;             // Client (EV_ARRIVE), connection (EV_SYN_RETRY, EV_READ), poll slot (EV_SEND) or shard (EV_PRODUCE)
+};
+
+struct EventQueue
+{
+    struct Event * heap;
+    int size;
+    int capacity;
+    uint64_t seq;
+};
+
+struct SimArguments
+{
+    float productionRate;
+    int clientCount;
+    int depoCapacity;
+    float readingRate;
+    float decayRate;
+    enum DecayPolicy decayPolicy;   // -m
+    double lifetime;                // -L, s, <0 - derived from -c and -d (konsument's -t)
+    int parallelCount;              // -j
+    double hours;
+    double arrivalSpread;
+    double dropChance;
+    int pipeSize;
+    int listenBacklog;
+    int workerCount;        // -w, one shard each
+    int groupSize;          // -b
+    bool early;             // -e
+    bool overflow;          // -o
+    int highWater;          // -H
+    bool intervalReports;
+};
+
+struct SimClient
+{
+    struct ClientStorage storage;   // Every block read, in virtual ms
+    int connections;        // Opened so far
+    int inFlight;
+    bool finished;
+    bool dropped;           // DC'd mid batch - konsument exits, its other connections hang up as well
+    bool refused;           // connect() timed out - konsument exits
+};
+
+struct SimConnection        // One of konsument's -j batch connections - a client to the server
+{
+    int client;
+    int readSum;            // Read by konsument
+    int received;           // Sent by the server - in the socket until it's read
+    int64_t startTime;      // Taken right before connect
+    int64_t acceptTime;
+    int64_t receiveTime;    // Last package sent - what's read next arrived then
+    int64_t nextRead;       // konsument's nextReadTS
+    int synRetries;         // Of the current connect()
+    bool active;
+    bool readPending;       // EV_READ scheduled
+};
+
+struct SimSlot
+{
+    int connection;         // -1 if free (not polled)
+    int batch;              // Batch the connection is sent (index in the pool)
+    int alreadySent;
+    int dropAt;             // Konsument DCs once this many bytes were sent (SEND_THRESHOLD+1 == never)
+    int64_t admitTime;
+    bool early;             // Bound to a filling batch
+    bool starved;           // Sent everything its filling batch had - out of the poll (no EV_SEND) until it grows
+};
+
+struct SimShard
+{
+    int pipeStorage;        // Bytes in the virtual pipe
+    int overflowTail;       // Append offset of the virtual overflow segment (rewound once it's drained)
+    int64_t blockedSince;
+    bool workerBlocked;
+};
+
+struct SimStats
+{
+    long long produced;
+    long long sent;
+    long long wasted;
+    long long batches;
+    long long recovered;
+    long long earlyAdmissions;
+    long long spilled;
+    int overflowPeak;
+    int64_t workerBlocked;
+    int64_t backlogWaitSum, backlogWaitMax;
+    int64_t queueWaitSum, queueWaitMax;
+    int64_t firstByteSum, firstByteMax;     // Connect - first byte, like konsument's timeToFirstByte
+    long long firstBytes;
+    int64_t fillTimeSum, fillTimeMax;
+    int finishedClients;
+    int droppedClients;
+    int refusedClients;
+    long long synDrops;
+    int maxConnections;
+    double percentageSum;
+    long long percentageSamples;
+};
+
+struct Simulation
+{
+    struct SimArguments args;
+    struct EventQueue events;
+    struct StorageShards shards;    // Only the storage (accounting) of every shard is used
+    struct SimShard shard[MAX_SHARDS];
+    struct Batch batches[POOL_BATCHES];
+    struct BatchPool pool;          // The server's batch bookkeeping (batch.c) over them, no batch data
+    struct SimSlot slots[MAX_CLIENTS];
+    struct SimClient * clients;
+    struct SimConnection * connections;     // parallelCount per client, client * parallelCount + i
+    struct buffer * backlog;        // Connected, not yet accepted (kernel accept queue, listenBacklog + 1 at most)
+    struct buffer * clientQueue;    // Accepted, waiting for a batch (same queue the server uses)
+    int clientDataSize;
+    int64_t now;
+    int64_t produceInterval;
+    uint64_t rngState;
+    struct SimStats stats;
+};
+
+void parseSimArguments(int, char **, struct SimArguments *);
+void initSimulation(struct Simulation *);
+void runSimulation(struct Simulation *);
+void pushEvent(struct EventQueue *, int64_t, int, int);
+struct Event popEvent(struct EventQueue *);
+void simProduce(struct Simulation *, int);
+void simArrive(struct Simulation *, int);
+void simOpenConnections(struct Simulation *, int);
+long simProjectedCapacity(struct Simulation *, int);
+void simConnect(struct Simulation *, int);
+void simSyn(struct Simulation *, int);
+void simClientExit(struct Simulation *, int);
+void simAccept(struct Simulation *);
+void simAdmit(struct Simulation *);
+void simWakeStarved(struct Simulation *);
+void simSpill(struct Simulation *);
+void simSend(struct Simulation *, int);
+void simDisconnect(struct Simulation *, int);
+void simRead(struct Simulation *, int);
+void simReadStorage(void *, int, char *, int);
+void simReadPipe(struct Simulation *, int, int);
+void simUpdateStorage(struct Simulation *, int);
+void simIntervalReport(struct Simulation *);
+void simSummary(struct Simulation *, double);
+double nextRandom(struct Simulation *);
+int64_t timespecToNs(struct timespec);
+
+int getInt(char * arg);
+double getFloat(char * arg);
+void usage(void);
+
+int main(int argc, char ** argv)
+{
+    struct Simulation sim;
+    memset(&sim, 0, sizeof(sim));
+    parseSimArguments(argc, argv, &sim.args);
+
+    struct timespec wallStart, wallEnd;
+    clock_gettime(CLOCK_MONOTONIC, &wallStart);
+    initSimulation(&sim);
+    runSimulation(&sim);
+    clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+
+    simSummary(&sim, (double)(timespecToNs(wallEnd) - timespecToNs(wallStart)) / NSEC);
+
+    delete(sim.backlog);
+    delete(sim.clientQueue);
+    delete(sim.pool.readyBatches);
+    for(int i = 0; i < sim.args.clientCount; i++)
+        clientStorageFree(&sim.clients[i].storage);
+    free(sim.clients);
+    free(sim.connections);
+    free(sim.events.heap);
+    return 0;
+}
+
+void initSimulation(struct Simulation * sim)
+{
+    struct timespec sleepTime = {};
+    parseTime(sim->args.productionRate, &sleepTime);         // Same pacing as workWork
+    sim->produceInterval = timespecToNs(sleepTime);
+    if(sim->produceInterval <= 0)
+        sim->produceInterval = 1;
+    sim->rngState = 0x9E3779B97F4A7C15ULL;
+
+    sim->clients = calloc(sim->args.clientCount, sizeof(struct SimClient));
+    sim->connections = calloc((size_t)sim->args.clientCount * sim->args.parallelCount, sizeof(struct SimConnection));
+    sim->backlog = create(sim->args.listenBacklog + 1);
+    sim->clientQueue = create(MAX_CLIENTS);
+    sim->events.capacity = sim->args.clientCount * sim->args.parallelCount + MAX_SHARDS + 16;
+    sim->events.heap = malloc(sim->events.capacity * sizeof(struct Event));
+    if(sim->clients == NULL || sim->connections == NULL || sim->events.heap == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < MAX_CLIENTS; i++)
+        sim->slots[i].connection = -1;
+    for(int i = 0; i < sim->args.clientCount * sim->args.parallelCount; i++)
+        sim->connections[i].client = i / sim->args.parallelCount;
+    initBatchPool(&sim->pool, sim->batches, NULL, sim->args.groupSize, simReadStorage, sim);
+    sim->pool.early = sim->args.early;
+
+    sim->shards.count = sim->args.workerCount;
+    sim->shards.highWater = sim->args.highWater;
+    for(int i = 0; i < sim->shards.count; i++)
+    {
+        sim->shards.storage[i].inflowRate = sim->args.productionRate * BASE_RATE / 1000;    // Same seed as setupStorage
+        pushEvent(&sim->events, sim->produceInterval, EV_PRODUCE, i);
+        simUpdateStorage(sim, i);
+    }
+    for(int i = 0; i < sim->args.clientCount; i++)
+    {
+        int64_t arrival = (int64_t)(nextRandom(sim) * sim->args.arrivalSpread * NSEC);
+        pushEvent(&sim->events, arrival, EV_ARRIVE, i);
+    }
+    pushEvent(&sim->events, REPORT_INTERVAL, EV_REPORT, 0);
+}
+
+void runSimulation(struct Simulation * sim)
+{
+    int64_t endTime = (int64_t)(sim->args.hours * 3600 * NSEC);
+    while(sim->events.size != 0)
+    {
+        struct Event event = popEvent(&sim->events);
+        if(event.time > endTime)
+            break;
+        sim->now = event.time;
+        switch(event.type)
+        {
+            case EV_PRODUCE:
+                simProduce(sim, event.id);
+                break;
+            case EV_ARRIVE:
+                simArrive(sim, event.id);
+                break;
+            case EV_SYN_RETRY:
+                simSyn(sim, event.id);
+                break;
+            case EV_SEND:
+                simSend(sim, event.id);
+                break;
+            case EV_READ:
+                simRead(sim, event.id);
+                break;
+            case EV_REPORT:
+            {
+                struct Storage storage;
+                aggregateStorage(&sim->shards, &storage);
+                if(sim->args.intervalReports)
+                    simIntervalReport(sim);
+                sim->stats.percentageSum += storage.percentage;
+                sim->stats.percentageSamples++;
+                for(int i = 0; i < sim->shards.count; i++)
+                    sim->shards.storage[i].prevStorage = sim->shards.storage[i].currentStorage;
+                pushEvent(&sim->events, sim->now + REPORT_INTERVAL, EV_REPORT, 0);
+                break;
+            }
+            default:
+                fprintf(stderr, "Unrecognized event\n");
+                exit(EXIT_FAILURE);
+        }
+        if(sim->stats.finishedClients + sim->stats.droppedClients + sim->stats.refusedClients == sim->args.clientCount)
+            break;
+        // Same order as the server's main loop: accept what fits, update the storage (FIONREAD), admit while there
+        // are batches, assemble the next ones (filling batches first), spill what's above the high-water mark
+        // and poll the clients starved by a filling batch again
+        simAccept(sim);
+        for(int i = 0; i < sim->shards.count; i++)
+            simUpdateStorage(sim, i);
+        simAdmit(sim);
+        assembleBatches(&sim->pool, &sim->shards);
+        simSpill(sim);
+        simWakeStarved(sim);
+    }
+    for(int i = 0; i < sim->shards.count; i++)
+        if(sim->shard[i].workerBlocked)
+            sim->stats.workerBlocked += sim->now - sim->shard[i].blockedSince;
+}
+
+void simProduce(struct Simulation * sim, int shard)
+{
+    struct SimShard * thisShard = &sim->shard[shard];
+    if(thisShard->pipeStorage + BLOCK_SIZE > sim->args.pipeSize)
+    {
+        // write() blocks until the server reads enough (see simReadPipe)
+        thisShard->workerBlocked = true;
+        thisShard->blockedSince = sim->now;
+        return;
+    }
+    thisShard->pipeStorage += BLOCK_SIZE;
+    sim->stats.produced += BLOCK_SIZE;
+    pushEvent(&sim->events, sim->now + sim->produceInterval, EV_PRODUCE, shard);
+}
+
+void simReadStorage(void * context, int shard, char * data, int amount)
+{
+    // The pool's readStorage (overflow.c) without the data: the overflow segment first, then the pipe
+    (void)data;
+    struct Simulation * sim = context;
+    struct Storage * storage = &sim->shards.storage[shard];
+    int fromOverflow = amount < storage->overflowData ? amount : storage->overflowData;
+    storage->overflowData -= fromOverflow;
+    if(fromOverflow != 0 && storage->overflowData == 0)
+        sim->shard[shard].overflowTail = 0;         // Served - rewound
+    simReadPipe(sim, shard, amount - fromOverflow);
+}
+
+void simReadPipe(struct Simulation * sim, int shard, int amount)
+{
+    // A blocked worker gets to write its block once there's room for it
+    struct SimShard * thisShard = &sim->shard[shard];
+    thisShard->pipeStorage -= amount;
+    sim->shards.storage[shard].drained += amount;
+    if(thisShard->workerBlocked && thisShard->pipeStorage + BLOCK_SIZE <= sim->args.pipeSize)
+    {
+        thisShard->workerBlocked = false;
+        sim->stats.workerBlocked += sim->now - thisShard->blockedSince;
+        thisShard->pipeStorage += BLOCK_SIZE;
+        sim->stats.produced += BLOCK_SIZE;
+        pushEvent(&sim->events, sim->now + sim->produceInterval, EV_PRODUCE, shard);
+    }
+}
+
+void simUpdateStorage(struct Simulation * sim, int shard)
+{
+    // updateStorage: the reads in between leave the accounting stale (like the server's), the forecast is sampled in virtual ms
+    struct Storage * storage = &sim->shards.storage[shard];
+    computeStorage(storage, sim->shard[shard].pipeStorage, sim->args.pipeSize + READY_BATCHES * SEND_THRESHOLD);
+    sampleInflow(storage, sim->shard[shard].pipeStorage, (int)(sim->now / 1000000));
+    if(storage->overflowData > sim->stats.overflowPeak)
+        sim->stats.overflowPeak = storage->overflowData;
+}
+
+void simArrive(struct Simulation * sim, int client)
+{
+    struct SimClient * thisClient = &sim->clients[client];
+    clientStorageSetup(&thisClient->storage, sim->args.decayPolicy, sim->args.decayRate, sim->args.depoCapacity,
+                       sim->args.lifetime, sim->now / 1000000);
+    simOpenConnections(sim, client);
+}
+
+void simOpenConnections(struct Simulation * sim, int client)
+{
+    // receiveData: new batch connections only while the projected capacity still has room for them
+    struct SimClient * thisClient = &sim->clients[client];
+    long depoCapacity = (long)sim->args.depoCapacity * CAPACITY_MULT;
+    for(int i = 0; i < sim->args.parallelCount; i++)
+    {
+        int connection = client * sim->args.parallelCount + i;
+        if(!sim->connections[connection].active && depoCapacity - simProjectedCapacity(sim, client) >= FULL_READ)
+            simConnect(sim, connection);
+    }
+    if(thisClient->inFlight != 0)
+        return;
+    thisClient->finished = true;        // Full capacity - konsument reports and exits
+    sim->stats.finishedClients++;
+    sim->stats.fillTimeSum += sim->now;
+    if(sim->now > sim->stats.fillTimeMax)
+        sim->stats.fillTimeMax = sim->now;
+    clientStorageFree(&thisClient->storage);
+}
+
+long simProjectedCapacity(struct Simulation * sim, int client)
+{
+    // projectedCapacity: the storage right now plus whatever the connections in flight still have to deliver
+    struct ClientStorage * storage = &sim->clients[client].storage;
+    clientStorageAdvance(storage, sim->now / 1000000);
+    long projected = (long)storage->capacity;
+    for(int i = 0; i < sim->args.parallelCount; i++)
+    {
+        struct SimConnection * thisConnection = &sim->connections[client * sim->args.parallelCount + i];
+        if(thisConnection->active)
+            projected += FULL_READ - thisConnection->readSum;
+    }
+    return projected;
+}
+
+void simConnect(struct Simulation * sim, int connection)
+{
+    struct SimConnection * thisConnection = &sim->connections[connection];
+    struct SimClient * thisClient = &sim->clients[thisConnection->client];
+    thisConnection->active = true;
+    thisConnection->readSum = 0;
+    thisConnection->received = 0;
+    thisConnection->nextRead = 0;
+    thisConnection->readPending = false;
+    thisConnection->startTime = sim->now;
+    thisConnection->synRetries = 0;
+    thisClient->inFlight++;
+    thisClient->connections++;
+    if(thisClient->connections > sim->stats.maxConnections)
+        sim->stats.maxConnections = thisClient->connections;
+    simSyn(sim, connection);
+}
+
+void simSyn(struct Simulation * sim, int connection)
+{
+    // The kernel takes a connection while its accept queue holds at most backlog + 1, otherwise the SYN is dropped
+    // and the client retransmits it with a doubling timeout - until connect() gives up
+    struct SimConnection * thisConnection = &sim->connections[connection];
+    struct SimClient * thisClient = &sim->clients[thisConnection->client];
+    if(thisClient->dropped || thisClient->refused)      // Konsument exited in the meantime
+        return;
+    if(getCurrentSize(sim->backlog) <= sim->args.listenBacklog)
+    {
+        push(sim->backlog, connection);
+        return;
+    }
+    sim->stats.synDrops++;
+    if(thisConnection->synRetries == SYN_RETRIES)
+    {
+        thisClient->refused = true;
+        sim->stats.refusedClients++;
+        simClientExit(sim, thisConnection->client);
+        return;
+    }
+    pushEvent(&sim->events, sim->now + (SYN_TIMEOUT << thisConnection->synRetries), EV_SYN_RETRY, connection);
+    thisConnection->synRetries++;
+}
+
+void simClientExit(struct Simulation * sim, int client)
+{
+    // Konsument exits - the server sees its other connections hang up once it polls them (simSend)
+    struct SimClient * thisClient = &sim->clients[client];
+    for(int i = 0; i < sim->args.parallelCount; i++)
+        sim->connections[client * sim->args.parallelCount + i].active = false;
+    thisClient->inFlight = 0;
+    clientStorageFree(&thisClient->storage);
+}
+
+void simAccept(struct Simulation * sim)
+{
+    // pollServer: accept only while queued + polled < MAX_CLIENTS
+    while(getCurrentSize(sim->backlog) != 0 && getCurrentSize(sim->clientQueue) + sim->clientDataSize < MAX_CLIENTS)
+    {
+        int connection = pop(sim->backlog);
+        int64_t backlogWait = sim->now - sim->connections[connection].startTime;
+        sim->stats.backlogWaitSum += backlogWait;
+        if(backlogWait > sim->stats.backlogWaitMax)
+            sim->stats.backlogWaitMax = backlogWait;
+        sim->connections[connection].acceptTime = sim->now;
+        push(sim->clientQueue, connection);
+    }
+}
+
+void simAdmit(struct Simulation * sim)
+{
+    // main: every batch taken out of the storage is bound to a group of queued connections (one without -b)
+    int batch;
+    while(getCurrentSize(sim->clientQueue) != 0 && ((batch = takeBatch(&sim->pool, &sim->shards)) != -1
+                                                   || (batch = takeEarlyBatch(&sim->pool, &sim->shards)) != -1))
+    {
+        for(int bound = 0; bound < sim->args.groupSize && getCurrentSize(sim->clientQueue) != 0; bound++)
+        {
+            int slot = 0;
+            while(sim->slots[slot].connection != -1)    // queued + polled < MAX_CLIENTS - there's always one
+                slot++;
+            struct SimSlot * thisSlot = &sim->slots[slot];
+            int connection = pop(sim->clientQueue);
+            thisSlot->connection = connection;
+            thisSlot->batch = batch;
+            thisSlot->alreadySent = 0;
+            thisSlot->admitTime = sim->now;
+            thisSlot->early = sim->pool.batches[batch].filling;
+            thisSlot->starved = false;
+            thisSlot->dropAt = SEND_THRESHOLD + 1;
+            if(sim->args.dropChance > 0 && nextRandom(sim) < sim->args.dropChance)
+                thisSlot->dropAt = (int)(nextRandom(sim) * SEND_THRESHOLD);
+            bindBatch(&sim->pool, batch);
+            sim->clientDataSize++;
+            if(thisSlot->early)
+                sim->stats.earlyAdmissions++;
+
+            int64_t queueWait = sim->now - sim->connections[connection].acceptTime;
+            sim->stats.queueWaitSum += queueWait;
+            if(queueWait > sim->stats.queueWaitMax)
+                sim->stats.queueWaitMax = queueWait;
+            pushEvent(&sim->events, sim->now + SEND_STEP, EV_SEND, slot);
+        }
+    }
+}
+
+void simWakeStarved(struct Simulation * sim)
+{
+    // wakeStarved: a client that caught up with its filling batch is polled again once the batch has more
+    for(int slot = 0; slot < MAX_CLIENTS; slot++)
+    {
+        struct SimSlot * thisSlot = &sim->slots[slot];
+        if(thisSlot->connection != -1 && thisSlot->starved && sim->pool.batches[thisSlot->batch].filled > thisSlot->alreadySent)
+        {
+            thisSlot->starved = false;
+            pushEvent(&sim->events, sim->now + SEND_STEP, EV_SEND, slot);
+        }
+    }
+}
+
+void simSpill(struct Simulation * sim)
+{
+    // spillOverflow: the pipe above the high-water mark goes to the shard's overflow segment
+    if(!sim->args.overflow)
+        return;
+    for(int shard = 0; shard < sim->shards.count; shard++)
+    {
+        struct SimShard * thisShard = &sim->shard[shard];
+        struct Storage * storage = &sim->shards.storage[shard];
+        int surplus = spillSurplus(storage, sim->shards.highWater, OVERFLOW_SEGMENT - thisShard->overflowTail);
+        if(surplus == 0)
+            continue;
+        thisShard->overflowTail += surplus;
+        storage->overflowData += surplus;      // Moved from the pipe to the overflow - still in the storage
+        sim->stats.spilled += surplus;
+        simReadPipe(sim, shard, surplus);
+    }
+}
+
+void simSend(struct Simulation * sim, int slot)
+{
+    struct SimSlot * thisSlot = &sim->slots[slot];
+    struct Batch * batch = &sim->pool.batches[thisSlot->batch];
+    struct SimConnection * thisConnection = &sim->connections[thisSlot->connection];
+    struct SimClient * thisClient = &sim->clients[thisConnection->client];
+
+    if(thisSlot->alreadySent == SEND_THRESHOLD)       // Transaction complete - close, reuse the slot
+    {
+        if(!thisSlot->early)
+            recordTransfer(&sim->pool, sim->now - thisSlot->admitTime);
+        releaseBatch(&sim->pool, &sim->shards, thisSlot->batch);
+        thisSlot->connection = -1;
+        sim->clientDataSize--;
+        sim->stats.batches++;
+        return;
+    }
+    if(thisClient->dropped || thisClient->refused || thisSlot->alreadySent >= thisSlot->dropAt)
+    {
+        simDisconnect(sim, slot);
+        return;
+    }
+    if(thisSlot->alreadySent == batch->filled)        // Caught up with its filling batch
+    {
+        thisSlot->starved = true;
+        return;
+    }
+
+    int sendSize = batch->filled - thisSlot->alreadySent < PACKAGE_SIZE ? batch->filled - thisSlot->alreadySent : PACKAGE_SIZE;
+    if(thisSlot->alreadySent == 0)
+    {
+        int64_t firstByte = sim->now - thisConnection->startTime;
+        sim->stats.firstByteSum += firstByte;
+        sim->stats.firstBytes++;
+        if(firstByte > sim->stats.firstByteMax)
+            sim->stats.firstByteMax = firstByte;
+    }
+    thisSlot->alreadySent += sendSize;
+    batch->sent = true;
+    sim->stats.sent += sendSize;
+    thisConnection->received += sendSize;
+    thisConnection->receiveTime = sim->now;
+    if(!thisConnection->readPending)                // konsument polls it again once its read pause is over
+    {
+        thisConnection->readPending = true;
+        pushEvent(&sim->events, thisConnection->nextRead > sim->now ? thisConnection->nextRead : sim->now, EV_READ,
+                  thisSlot->connection);
+    }
+    pushEvent(&sim->events, sim->now + SEND_STEP, EV_SEND, slot);
+}
+
+void simDisconnect(struct Simulation * sim, int slot)
+{
+    // Same as the POLLHUP branch of pollClients - only what was read for the client and not sent is wasted
+    struct SimSlot * thisSlot = &sim->slots[slot];
+    struct Batch * batch = &sim->pool.batches[thisSlot->batch];
+    int client = sim->connections[thisSlot->connection].client;
+    if(batch->sent)
+        sim->stats.wasted += (batch->filling ? batch->filled : SEND_THRESHOLD) - thisSlot->alreadySent;
+    else if(batch->refCount == 1)       // Nothing sent from it - back to the storage
+        sim->stats.recovered += batch->filled;
+    releaseBatch(&sim->pool, &sim->shards, thisSlot->batch);
+    if(!sim->clients[client].dropped && !sim->clients[client].refused)      // The DC itself, not one of the hang ups after it
+    {
+        sim->clients[client].dropped = true;
+        sim->stats.droppedClients++;
+        simClientExit(sim, client);
+    }
+    thisSlot->connection = -1;
+    sim->clientDataSize--;
+}
+
+void simRead(struct Simulation * sim, int connection)
+{
+    // readFromServer: one read of up to READ_SIZE, the next one only after readNum / (rate * READ_RATE)
+    struct SimConnection * thisConnection = &sim->connections[connection];
+    struct SimClient * thisClient = &sim->clients[thisConnection->client];
+    thisConnection->readPending = false;
+    if(!thisConnection->active)         // Konsument exited
+        return;
+    if(thisConnection->readSum == FULL_READ)        // EOF - the server closed it right after the last package
+    {
+        thisConnection->active = false;
+        thisClient->inFlight--;
+        simOpenConnections(sim, thisConnection->client);
+        return;
+    }
+    if(thisConnection->received == thisConnection->readSum)    // Nothing in the socket - simSend schedules the read
+        return;
+
+    int readNum = FULL_READ - thisConnection->readSum > READ_SIZE ? READ_SIZE : FULL_READ - thisConnection->readSum;
+    if(readNum > thisConnection->received - thisConnection->readSum)
+        readNum = thisConnection->received - thisConnection->readSum;
+    thisConnection->readSum += readNum;
+    clientStorageAdd(&thisClient->storage, readNum, thisConnection->receiveTime / 1000000);    // In storage from the moment it arrived
+    thisConnection->nextRead = sim->now + (int64_t)(readNum / (sim->args.readingRate * READ_RATE) * NSEC);
+    thisConnection->readPending = true;
+    pushEvent(&sim->events, thisConnection->nextRead, EV_READ, connection);
+    simOpenConnections(sim, thisConnection->client);    // Decay may have made room for another connection
+}
+
+void simIntervalReport(struct Simulation * sim)
+{
+    struct Storage storage;
+    aggregateStorage(&sim->shards, &storage);
+    fprintf(stderr, "\n-----INTERVAL REPORT-----\n");
+    fprintf(stderr, "Virtual time: %.3lfs\n", (double)sim->now / NSEC);
+    fprintf(stderr, "Clients - total: %d, polled: %d, queued: %d, backlog: %d\n",
+            sim->clientDataSize + getCurrentSize(sim->clientQueue), sim->clientDataSize,
+            getCurrentSize(sim->clientQueue), getCurrentSize(sim->backlog));
+    fprintf(stderr, "Flow: %d\n", storage.currentStorage - storage.prevStorage);
+    fprintf(stderr, "Storage status : %d, %2.2f %%, overflow: %d\n", storage.currentStorage, storage.percentage * 100,
+            storage.overflowData);
+    fprintf(stderr, "Batches - ready: %d, bound: %d\n", getCurrentSize(sim->pool.readyBatches), batchesInUse(&sim->pool));
+    fprintf(stderr, "-------------------------\n");
+}
+
+void simSummary(struct Simulation * sim, double wallTime)
+{
+    struct SimStats * stats = &sim->stats;
+    double virtualTime = (double)sim->now / NSEC;
+    long long accepted = stats->batches + stats->droppedClients;
+    fprintf(stderr, "\n-----SIMULATION REPORT-----\n");
+    fprintf(stderr, "Virtual time: %.3lfs, wall time: %.3lfs\n", virtualTime, wallTime);
+    fprintf(stderr, "Production rate: %.0lf B/s (%d workers), worker blocked: %.2lf %%\n",
+            sim->args.productionRate * BASE_RATE * sim->args.workerCount, sim->args.workerCount,
+            virtualTime > 0 ? (double)stats->workerBlocked / sim->args.workerCount / NSEC / virtualTime * 100 : 0.0);
+    fprintf(stderr, "Produced: %lld, sent: %lld, wasted: %lld, recovered: %lld (bytes)\n",
+            stats->produced, stats->sent, stats->wasted, stats->recovered);
+    fprintf(stderr, "Batches served: %lld (%.2lf per second), broadcast group: %d, early admissions: %lld\n",
+            stats->batches, virtualTime > 0 ? stats->batches / virtualTime : 0.0, sim->args.groupSize,
+            stats->earlyAdmissions);
+    fprintf(stderr, "Average storage status: %2.2f %%\n",
+            stats->percentageSamples ? stats->percentageSum / stats->percentageSamples * 100 : 0.0);
+    if(sim->args.overflow)
+        fprintf(stderr, "Overflow - high-water mark: %d %%, spilled: %lld, peak of a shard: %d (bytes)\n", sim->args.highWater,
+                stats->spilled, stats->overflowPeak);
+    fprintf(stderr, "Backlog wait - avg: %.3lfs, max: %.3lfs\n",
+            accepted ? (double)stats->backlogWaitSum / accepted / NSEC : 0.0, (double)stats->backlogWaitMax / NSEC);
+    fprintf(stderr, "Queue wait - avg: %.3lfs, max: %.3lfs\n",
+            accepted ? (double)stats->queueWaitSum / accepted / NSEC : 0.0, (double)stats->queueWaitMax / NSEC);
+    fprintf(stderr, "Time to first byte - avg: %.3lfs, max: %.3lfs\n",
+            stats->firstBytes ? (double)stats->firstByteSum / stats->firstBytes / NSEC : 0.0, (double)stats->firstByteMax / NSEC);
+    fprintf(stderr, "Listen backlog: %d, SYNs dropped: %lld, connects timed out: %d\n", sim->args.listenBacklog,
+            stats->synDrops, stats->refusedClients);
+    fprintf(stderr, "Client storage: %s decay, parallel connections: %d\n", decayPolicyName(sim->args.decayPolicy),
+            sim->args.parallelCount);
+    fprintf(stderr, "Clients - total: %d, filled: %d, dropped: %d, timed out: %d, unfinished: %d\n", sim->args.clientCount,
+            stats->finishedClients, stats->droppedClients, stats->refusedClients,
+            sim->args.clientCount - stats->finishedClients - stats->droppedClients - stats->refusedClients);
+    fprintf(stderr, "Fill time - avg: %.3lfs, max: %.3lfs, max connections per client: %d\n",
+            stats->finishedClients ? (double)stats->fillTimeSum / stats->finishedClients / NSEC : 0.0,
+            (double)stats->fillTimeMax / NSEC, stats->maxConnections);
+    fprintf(stderr, "---------------------------\n");
+}
+
+void pushEvent(struct EventQueue * queue, int64_t time, int type, int id)
+{
+    if(queue->size == queue->capacity)
+    {
+        queue->capacity *= 2;
+        struct Event * resized = realloc(queue->heap, queue->capacity * sizeof(struct Event));
+        if(resized == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        queue->heap = resized;
+    }
+    struct Event event = {.time = time, .seq = queue->seq++, .type = type, .id = id};
+    int i = queue->size++;
+    while(i > 0)        // Sift up
+    {
+        int parent = (i - 1) / 2;
+        struct Event * p = &queue->heap[parent];
+        if(p->time < event.time || (p->time == event.time && p->seq < event.seq))
+            break;
+        queue->heap[i] = *p;
+        i = parent;
+    }
+    queue->heap[i] = event;
+}
+
+struct Event popEvent(struct EventQueue * queue)
+{
+    struct Event top = queue->heap[0];
+    struct Event last = queue->heap[--queue->size];
+    int i = 0;
+    while(1)            // Sift down
+    {
+        int child = 2 * i + 1;
+        if(child >= queue->size)
+            break;
+        if(child + 1 < queue->size && (queue->heap[child + 1].time < queue->heap[child].time ||
+           (queue->heap[child + 1].time == queue->heap[child].time && queue->heap[child + 1].seq < queue->heap[child].seq)))
+            child++;
+        if(last.time < queue->heap[child].time || (last.time == queue->heap[child].time && last.seq < queue->heap[child].seq))
+            break;
+        queue->heap[i] = queue->heap[child];
+        i = child;
+    }
+    queue->heap[i] = last;
+    return top;
+}
+
+double nextRandom(struct Simulation * sim)
+{
+    // xorshift64* with a fixed seed - same input, same run
+    sim->rngState ^= sim->rngState >> 12;
+    sim->rngState ^= sim->rngState << 25;
+    sim->rngState ^= sim->rngState >> 27;
+    return (double)((sim->rngState * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+int64_t timespecToNs(struct timespec ts)
+{
+    return (int64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+void parseSimArguments(int argc, char ** argv, struct SimArguments * args)
+{
+    bool pFlag = false, nFlag = false, cFlag = false, rFlag = false, dFlag = false;
+    args->decayPolicy = DECAY_LINEAR;
+    args->lifetime = -1;
+    args->parallelCount = 1;
+    args->hours = 1;
+    args->arrivalSpread = 0;
+    args->dropChance = 0;
+    args->pipeSize = PIPE_SIZE;
+    args->listenBacklog = LISTEN_BACKLOG;
+    args->workerCount = 1;
+    args->groupSize = 1;
+    args->early = false;
+    args->overflow = false;
+    args->highWater = HIGH_WATER;
+    args->intervalReports = false;
+    if(argc < 2 || strcmp(argv[1], "--help") == 0)
+        usage();
+    int opt;
+    while ((opt = getopt(argc, argv, ":p:n:c:r:d:m:L:j:t:a:x:s:l:w:b:eoH:i")) != -1) {
+        switch (opt) {
+            case 'p':
+                args->productionRate = (float)getFloat(optarg);
+                pFlag = true;
+                break;
+            case 'n':
+                args->clientCount = getInt(optarg);
+                nFlag = true;
+                break;
+            case 'c':
+                args->depoCapacity = getInt(optarg);
+                cFlag = true;
+                break;
+            case 'r':
+                args->readingRate = (float)getFloat(optarg);
+                rFlag = true;
+                break;
+            case 'd':
+                args->decayRate = (float)getFloat(optarg);
+                dFlag = true;
+                break;
+            case 'm':
+                if(!parseDecayPolicy(optarg, &args->decayPolicy))
+                {
+                    fprintf(stderr, "Decay policy has to be linear, ttl or exp\n");
+                    usage();
+                }
+                break;
+            case 'L':
+                args->lifetime = getFloat(optarg);
+                break;
+            case 'j':
+                args->parallelCount = getInt(optarg);
+                if(args->parallelCount < 1 || args->parallelCount > MAX_PARALLEL)
+                {
+                    fprintf(stderr, "Parallel connection count has to be between 1 and %d\n", MAX_PARALLEL);
+                    usage();
+                }
+                break;
+            case 't':
+                args->hours = getFloat(optarg);
+                break;
+            case 'a':
+                args->arrivalSpread = getFloat(optarg);
+                break;
+            case 'x':
+                args->dropChance = getFloat(optarg);
+                break;
+            case 's':
+                args->pipeSize = getInt(optarg);
+                break;
+            case 'l':
+                args->listenBacklog = getInt(optarg);
+                break;
+            case 'w':
+                args->workerCount = getInt(optarg);
+                if(args->workerCount < 1 || args->workerCount > MAX_SHARDS)
+                {
+                    fprintf(stderr, "Worker count has to be between 1 and %d\n", MAX_SHARDS);
+                    usage();
+                }
+                break;
+            case 'b':
+                args->groupSize = getInt(optarg);
+                if(args->groupSize < 1 || args->groupSize > MAX_CLIENTS)
+                {
+                    fprintf(stderr, "Broadcast group size has to be between 1 and %d\n", MAX_CLIENTS);
+                    usage();
+                }
+                break;
+            case 'e':
+                args->early = true;
+                break;
+            case 'o':
+                args->overflow = true;
+                break;
+            case 'H':
+                args->highWater = getInt(optarg);
+                if(args->highWater < 1 || args->highWater > 100)
+                {
+                    fprintf(stderr, "High-water mark has to be between 1 and 100 (%%)\n");
+                    usage();
+                }
+                break;
+            case 'i':
+                args->intervalReports = true;
+                break;
+            case ':': // Missing argument
+                fprintf(stderr, "Missing argument!\n");
+                usage();
+                break;
+            case '?': // Unrecognized option
+                fprintf(stderr, "Unrecognized option: %c%c, arg: %d\n",
+                        argv[optind - 1][0],argv[optind - 1][1], optind-1);
+                usage();
+                break;
+            default: // Unrecognized case in switch
+                fprintf(stderr, "Unrecognized case\n");
+                usage();
+        }
+    }
+    if(!pFlag || !nFlag || !cFlag || !rFlag || !dFlag)
+    {
+        fprintf(stderr, "Did not find required flags!\n");
+        usage();
+    }
+    if(args->productionRate == 0 || args->readingRate == 0 || args->clientCount == 0 || args->pipeSize < SEND_THRESHOLD)
+    {
+        fprintf(stderr, "Rates and client count have to be positive, pipe size at least %d\n", SEND_THRESHOLD);
+        usage();
+    }
+}
+
+void usage(void)
+{
+    fprintf(stderr, "USAGE: -p <float> -n <int> -c <int> -r <float> -d <float> "
+                    "[-m <linear|ttl|exp>] [-L <float>] [-j <int>] [-t <hours>] [-a <float>] [-x <float>] [-s <int>] [-l <int>] [-w <int>] [-b <int>] [-e] [-o] [-H <int>] [-i]\n");
+    exit(EXIT_FAILURE);
+}
+
+double getFloat(char * arg)
+{
+    double res;
+    char *endptr;
+    errno = 0;
+    res = strtod(arg, &endptr);
+    if (errno != 0)
+        perror("strtod");
+    if (*endptr != '\0')
+    {
+        fprintf(stderr,"Non-numeric argument: %s, at %s, arg: %d\n", arg, endptr, optind-1);
+        usage();
+    }
+    if (res < 0)
+    {
+        fprintf(stderr,"Negative values not allowed\n");
+        usage();
+    }
+    return res;
+}
+
+int getInt(char * arg)
+{
+    int res;
+    char *endptr;
+    errno = 0;
+    res = (int) strtol(arg, &endptr, 0);
+    if (errno != 0)
+        perror("strtol");
+    if (*endptr != '\0')
+    {
+        fprintf(stderr,"Non-numeric argument: %s, at %s, arg: %d\n", arg, endptr, optind-1);
+        usage();
+    }
+    if (res < 0)
+    {
+        fprintf(stderr,"Negative values not allowed\n");
+        usage();
+    }
+    return res;
+}
@@ -0,0 +1,140 @@
+#include "storage.h"
+
+void computeStorage(struct Storage * storage, int currentStorage, int pipeSize)
+{
+    storage->currentStorage = currentStorage + storage->cachedData + storage->overflowData;
+    storage->freeData = storage->currentStorage;        // Batches leave the storage once they're bound
+    storage->percentage =(float)(currentStorage + storage->cachedData)/(float)pipeSize;
+    storage->capacity = pipeSize;
+}
+
+void aggregateStorage(struct StorageShards * shards, struct Storage * total)
+{
+    // All the shards seen as one storage (for the reports)
+    total->currentStorage = total->prevStorage = total->freeData = total->capacity = 0;
+    total->cachedData = total->overflowData = 0;
+    for(int i = 0; i < shards->count; i++)
+    {
+        total->currentStorage += shards->storage[i].currentStorage;
+        total->prevStorage += shards->storage[i].prevStorage;
+        total->freeData += shards->storage[i].freeData;
+        total->capacity += shards->storage[i].capacity;
+        total->cachedData += shards->storage[i].cachedData;
+        total->overflowData += shards->storage[i].overflowData;
+    }
+    total->percentage = primaryPercentage(total);
+}
+
+float primaryPercentage(struct Storage * storage)
+{
+    // Pipe + ready batches of the capacity from the current accounting (a spill since the last update included)
+    return storage->capacity ? (float)(storage->currentStorage - storage->overflowData)/(float)storage->capacity : 0;
+}
+
+bool canAssemble(struct Storage * storage)
+{
+    // A whole batch in the pipe (+ overflow) and room for it among the ready ones
+    return storage->currentStorage - storage->cachedData >= SEND_THRESHOLD
+           && storage->cachedData < READY_BATCHES * SEND_THRESHOLD;
+}
+
+void cacheBatch(struct Storage * storage)
+{
+    // Moved from the pipe into a ready batch - still in the storage
+    cacheData(storage, SEND_THRESHOLD);
+}
+
+void takeCachedBatch(struct Storage * storage)
+{
+    // Ready batch bound to a client - it leaves the storage
+    takeCachedData(storage, SEND_THRESHOLD);
+}
+
+void returnCachedBatch(struct Storage * storage)
+{
+    // Client(s) left before anything was sent - the batch is ready again
+    returnCachedData(storage, SEND_THRESHOLD);
+}
+
+void cacheData(struct Storage * storage, int amount)
+{
+    storage->cachedData += amount;
+}
+
+void takeCachedData(struct Storage * storage, int amount)
+{
+    storage->cachedData -= amount;
+    storage->currentStorage -= amount;
+    storage->freeData -= amount;
+}
+
+void returnCachedData(struct Storage * storage, int amount)
+{
+    storage->cachedData += amount;
+    storage->currentStorage += amount;
+    storage->freeData += amount;
+}
+
+void drainStorage(struct Storage * storage, int amount)
+{
+    // Read straight into a batch that is already bound (-e) - it leaves the storage
+    storage->currentStorage -= amount;
+    storage->freeData -= amount;
+}
+
+void sampleInflow(struct Storage * storage, int pipeContents, int now)
+{
+    // Production = growth of the pipe + whatever was read out of it meanwhile, now in ms
+    int elapsed = (int)((unsigned)now - (unsigned)storage->lastSample);     // ms timestamps wrap
+    if(elapsed < INFLOW_WINDOW)
+        return;
+    float sample = (float)(pipeContents - storage->lastPipe + storage->drained) / (float)elapsed;
+    storage->inflowRate += INFLOW_WEIGHT * (sample - storage->inflowRate);
+    storage->lastPipe = pipeContents;
+    storage->drained = 0;
+    storage->lastSample = now;
+}
+
+long long forecastTime(struct Storage * storage, int amount)
+{
+    // ns the shard is forecast to take producing amount bytes (with a safety margin), -1 - no production
+    if(storage->inflowRate <= 0)
+        return -1;
+    return (long long)((double)amount / (storage->inflowRate * FORECAST_MARGIN) * 1000000);
+}
+
+bool canAdmitEarly(struct Storage * storage, int inHand, long long transferNs)
+{
+    // -e: a client bound now is delivered the batch once the shard has produced the rest of it (the horizon).
+    // Worth it while that's no later than a client queued for a batch of fresh production waits for it to be delivered
+    // - a whole batch at the forecast rate plus its transfer. The margin keeps a stalling shard from taking clients.
+    long long horizon = forecastTime(storage, SEND_THRESHOLD - inHand);
+    return horizon != -1 && horizon <= (long long)(SEND_THRESHOLD / storage->inflowRate * 1000000) + transferNs;
+}
+
+long long averageTransfer(long long transferNs, long long sample)
+{
+    // EWMA of whole batch transfers (admission - last byte), 0 - no sample yet
+    return transferNs == 0 ? sample : transferNs + (sample - transferNs) / 4;
+}
+
+int spillSurplus(struct Storage * storage, int highWater, int room)
+{
+    // -o: pipe contents above the high-water mark (% of the primary storage) that go to the overflow,
+    // at most room and a package at least (so a busy pipe isn't spilled a block at a time), otherwise 0
+    int pipeContents = storage->currentStorage - storage->cachedData - storage->overflowData;
+    int surplus = storage->currentStorage - storage->overflowData - storage->capacity * highWater / 100;
+    if(surplus > pipeContents)
+        surplus = pipeContents;
+    if(surplus > room)
+        surplus = room;
+    return surplus < PACKAGE_SIZE ? 0 : surplus;
+}
+
+void parseTime(float productionRate, struct timespec * sleepTime)
+{
+    // First translate to nano seconds so we don't lose data from float precision and simple division
+    size_t nanoTime = BLOCK_SIZE / (productionRate * BASE_RATE) * 1000000000;
+    sleepTime->tv_sec = nanoTime / 1000000000;
+    sleepTime->tv_nsec = nanoTime % (size_t)(1000000000);
+}
@@ -0,0 +1,64 @@
+#ifndef MODELMIESZANY_STORAGE_H
+#define MODELMIESZANY_STORAGE_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#define BASE_RATE 2662
+#define BLOCK_SIZE 650
+#define MAX_CLIENTS 100
+#define LISTEN_BACKLOG 5        // listen() backlog of the server socket
+#define PACKAGE_SIZE 4096
+#define SEND_THRESHOLD 13312
+#define MAX_SHARDS 16           // Max amount of workers (-w), each with its own storage pipe
+#define READY_BATCHES 2         // Batches the server assembles out of every pipe ahead of admission
+#define INFLOW_WINDOW 100       // ms - shortest span the production forecast is sampled over
+#define INFLOW_WEIGHT 0.25f     // Weight of the newest sample in the forecast
+#define FORECAST_MARGIN 0.8f    // Early admission (-e) counts on this much of the forecast production rate only
+
+struct Storage
+{
+    int currentStorage;
+    int prevStorage;        // Stored to compare in the 5 sec intervals
+    int freeData;
+    float percentage;       // Primary storage (pipe + ready batches) only
+    int capacity;           // F_GETPIPE_SZ (+ the ready batches)
+    int cachedData;         // Already read out of the pipe into ready batches (counts as storage)
+    int overflowData;       // Spilled into the overflow segment (-o) - counts as storage, served before the pipe
+    float inflowRate;       // Production forecast - bytes per ms flowing into the pipe (EWMA)
+    int drained;            // Read out of the pipe since the last forecast sample
+    int lastPipe;           // Pipe contents at the last forecast sample
+    int lastSample;         // ms (CLOCK_MONOTONIC) of the last forecast sample
+};
+
+struct StorageShards
+{
+    int count;
+    int pipeRead[MAX_SHARDS];
+    int controlWrite[MAX_SHARDS];       // Feedback for the adaptive workers, -1 without -a
+    char * overflow;                    // -o, mmap'd overflow segments (overflow.h), NULL - no overflow tier
+    int overflowFd;
+    int highWater;                      // -H, primary storage fill (%) above which the pipe spills into the overflow
+    struct Storage storage[MAX_SHARDS];
+};
+
+// Storage accounting shared by the server and the simulator (no syscalls in here)
+void computeStorage(struct Storage *, int, int);
+void aggregateStorage(struct StorageShards *, struct Storage *);
+float primaryPercentage(struct Storage *);
+bool canAssemble(struct Storage *);
+void cacheBatch(struct Storage *);
+void takeCachedBatch(struct Storage *);
+void returnCachedBatch(struct Storage *);
+void cacheData(struct Storage *, int);
+void takeCachedData(struct Storage *, int);
+void returnCachedData(struct Storage *, int);
+void drainStorage(struct Storage *, int);
+void sampleInflow(struct Storage *, int, int);
+long long forecastTime(struct Storage *, int);
+bool canAdmitEarly(struct Storage *, int, long long);
+long long averageTransfer(long long, long long);
+int spillSurplus(struct Storage *, int, int);
+void parseTime(float, struct timespec *);
+
+#endif //MODELMIESZANY_STORAGE_H
@@ -0,0 +1,124 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+struct TraceLog traceLog = {};
+volatile sig_atomic_t traceStop = 0;
+
+static void traceDump(void);
+static void onStopSignal(int);
+
+void traceInit(const char * prefix, const char * processName)
+{
+    // SIGINT/SIGTERM only set a flag - the loops exit through exit() and the dump runs at exit
+    traceLog.events = malloc(TRACE_EVENTS * sizeof(struct TraceEvent));
+    if(traceLog.events == NULL)
+    {
+        perror("malloc trace");
+        exit(EXIT_FAILURE);
+    }
+    traceLog.next = 0;
+    traceLog.prefix = prefix;
+    traceLog.processName = processName;
+    struct sigaction action = {};
+    action.sa_handler = onStopSignal;       // No SA_RESTART - poll/nanosleep/write return EINTR
+    sigemptyset(&action.sa_mask);
+    errno = 0;
+    if(sigaction(SIGINT, &action, NULL) == -1 || sigaction(SIGTERM, &action, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+    errno = 0;
+    if(atexit(traceDump) != 0)
+    {
+        perror("registering atexit");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void traceFork(const char * processName)
+{
+    // Child keeps the handlers and the atexit dump, but starts with an empty ring of its own
+    if(traceLog.events == NULL)
+        return;
+    traceLog.next = 0;
+    traceLog.processName = processName;
+}
+
+void traceRecord(int type, int id, int value)
+{
+    // Single writer per process, the atomic increment keeps a signal handler from tearing the index
+    unsigned long long slot = __atomic_fetch_add(&traceLog.next, 1, __ATOMIC_RELAXED) % TRACE_EVENTS;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    traceLog.events[slot] = (struct TraceEvent){.timestamp = (long long)now.tv_sec * 1000000000LL + now.tv_nsec,
+                                                .type = type, .id = id, .value = value};
+}
+
+static void onStopSignal(int signalNumber)
+{
+    (void)signalNumber;
+    traceStop = 1;
+}
+
+static void traceDump(void)
+{
+    // Chrome trace event format (chrome://tracing, ui.perfetto.dev), timestamps in us.
+    // Every client fd is a track: "queued" from accept to admission, "transfer" from admission to complete/disconnect.
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d.json", traceLog.prefix, getpid());
+    errno = 0;
+    FILE * out = fopen(path, "w");
+    if(out == NULL)
+    {
+        perror("fopen trace");
+        return;
+    }
+    int pid = getpid();
+    fprintf(out, "{\"traceEvents\": [\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"%s\"}}",
+            pid, traceLog.processName);
+    unsigned long long first = traceLog.next > TRACE_EVENTS ? traceLog.next - TRACE_EVENTS : 0;
+    for(unsigned long long i = first; i < traceLog.next; i++)
+    {
+        struct TraceEvent * event = &traceLog.events[i % TRACE_EVENTS];
+        double ts = event->timestamp / 1e3;
+        switch(event->type)
+        {
+            case TRACE_ACCEPT:
+                fprintf(out, ",\n{\"name\": \"accept\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3lf, \"pid\": %d, \"tid\": %d}", ts, pid, event->id);
+                fprintf(out, ",\n{\"name\": \"queued\", \"ph\": \"B\", \"ts\": %.3lf, \"pid\": %d, \"tid\": %d}", ts, pid, event->id);
+                break;
+            case TRACE_ADMIT:
+                fprintf(out, ",\n{\"name\": \"queued\", \"ph\": \"E\", \"ts\": %.3lf, \"pid\": %d, \"tid\": %d}", ts, pid, event->id);
+                fprintf(out, ",\n{\"name\": \"transfer\", \"ph\": \"B\", \"ts\": %.3lf, \"pid\": %d, \"tid\": %d, \"args\": {\"batch\": %d}}",
+                        ts, pid, event->id, event->value);
+                break;
+            case TRACE_SEND:
+                fprintf(out, ",\n{\"name\": \"send\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3lf, \"pid\": %d, \"tid\": %d, \"args\": {\"bytes\": %d}}",
+                        ts, pid, event->id, event->value);
+                break;
+            case TRACE_COMPLETE:
+            case TRACE_DISCONNECT:
+                fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3lf, \"pid\": %d, \"tid\": %d, \"args\": {\"wasted\": %d}}",
+                        event->type == TRACE_COMPLETE ? "complete" : "disconnect", ts, pid, event->id, event->value);
+                fprintf(out, ",\n{\"name\": \"transfer\", \"ph\": \"E\", \"ts\": %.3lf, \"pid\": %d, \"tid\": %d}", ts, pid, event->id);
+                break;
+            case TRACE_ASSEMBLE:
+                fprintf(out, ",\n{\"name\": \"assemble\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3lf, \"pid\": %d, \"tid\": %d, \"args\": {\"shard\": %d, \"batch\": %d}}",
+                        ts, pid, -1 - event->id, event->id, event->value);     // Shards get negative tracks, clients are fds
+                break;
+            default:
+                fprintf(out, ",\n{\"name\": \"produce\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3lf, \"pid\": %d, \"tid\": %d, \"args\": {\"bytes\": %d}}",
+                        ts, pid, event->id, event->value);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    fprintf(stderr, "Trace: %llu events, %llu dropped, written to %s\n", traceLog.next - first, first, path);
+}
@@ -0,0 +1,57 @@
+#ifndef MODELMIESZANY_TRACE_H
+#define MODELMIESZANY_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
+
+#define TRACE_EVENTS (1 << 18)          // Ring size per process - the oldest events are overwritten
+
+// Client lifecycle (id - client fd) and production (id - shard / worker) events
+enum TraceType
+{
+    TRACE_ACCEPT,           // Accepted and queued
+    TRACE_ADMIT,            // Bound to a batch (value - batch index)
+    TRACE_SEND,             // One send() (value - bytes)
+    TRACE_COMPLETE,         // Whole batch sent
+    TRACE_DISCONNECT,       // Client went away (value - wasted bytes)
+    TRACE_ASSEMBLE,         // Batch read out of a shard's pipe (value - batch index)
+    TRACE_PRODUCE           // Worker wrote a block (value - bytes)
+};
+
+struct TraceEvent
+{
+    long long timestamp;    // ns, CLOCK_MONOTONIC
+    int type;
+    int id;
+    int value;
+};
+
+struct TraceLog
+{
+    struct TraceEvent * events;         // NULL - tracing is off
+    unsigned long long next;            // Total events recorded, the ring index is next % TRACE_EVENTS
+    const char * prefix;                // Dumped to <prefix>.<pid>.json
+    const char * processName;
+};
+
+extern struct TraceLog traceLog;
+extern volatile sig_atomic_t traceStop;
+
+void traceInit(const char *, const char *);
+void traceFork(const char *);
+void traceRecord(int, int, int);
+
+// Tracing off - one predictable branch
+static inline void trace(int type, int id, int value)
+{
+    if(__builtin_expect(traceLog.events != NULL, 0))
+        traceRecord(type, id, value);
+}
+
+static inline bool traceStopped(void)
+{
+    return __builtin_expect(traceStop, 0);
+}
+
+#endif //MODELMIESZANY_TRACE_H
@@ -0,0 +1,19 @@
+#ifndef MODELMIESZANY_STATUS_H
+#define MODELMIESZANY_STATUS_H
+
+#include <stdint.h>
+
+// Status query over UDP on the producent's own port - konsument picks the least loaded producent with it.
+// Request: STATUS_MAGIC alone, reply: struct StatusReply. Everything in network byte order.
+#define STATUS_MAGIC 0x42465331         // "BFS1"
+
+struct StatusReply
+{
+    uint32_t magic;
+    uint32_t queued;                    // Clients waiting for a batch
+    uint32_t polled;                    // Clients being sent a batch
+    uint32_t currentStorage;            // Same numbers as the interval report
+    uint32_t freeData;                  // Storage no client is bound to yet
+};
+
+#endif //MODELMIESZANY_STATUS_H